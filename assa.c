@@ -15,28 +15,154 @@
 //-----------------------------------------------------------------------------
 //
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-#define MSG_PARAMETER "usage: ./assa [float:angle] [float:speed] "\
-"[output_filename] {optional:config_filename}\n"
+#define MSG_PARAMETER "usage: ./assa {options} [float:angle] [float:speed] "\
+"[output_filename] {optional:config_filename}\n"\
+"       ./assa --batch [job_filename|-] {options} "\
+"{optional:config_filename}\n"\
+"       ./assa --sweep [name=from:to:step,...] {options} "\
+"[output_filename|-] {optional:config_filename}\n"\
+"       ./assa --overlay shot_filename {options} [output_filename|-] "\
+"{optional:config_filename}\n"\
+"       ./assa --serve socket_path {options} {optional:config_filename}\n"\
+"       ./assa [--solve x,y{,speed}|--solve-batch target_filename|-] "\
+"{optional:config_filename}\n"\
+"options: --workers [int:count] --band [int:rows] --threads [int:count] "\
+"--stats --draw [polyline|parabola|fused] "\
+"--format [bmp24|bmp8|bmp4|rle8|rle4|png|svg] --level [0-9] --mmap "\
+"--composite --record [csv|binary] --animate [y4m|ppm|bmp] "\
+"--layers [directory] --cache [directory] --cache-size [int:MiB] "\
+"--shm [name] --shm-slots [int:count] --shm-slot [int:MiB]\n"
 #define MSG_OOM "error: out of memory\n"
 #define MSG_WRITE "error: couldn't write file\n"
 #define MSG_SPEED "error: speed must be > 0\n"
 #define MSG_CONFIG "no config file found - using default values\n"
+#define MSG_JOB "error: invalid job line\n"
+#define MSG_COLORS "error: too many colors for the output format\n"
+#define MSG_BITMAP "error: not an uncompressed 24 bit bitmap\n"
+#define MSG_SLOT "error: not an uncompressed bitmap that fits a shared "\
+"memory slot\n"
+#define MSG_SAMPLE_LIMIT "error: too many samples before the shot leaves the "\
+"bitmap\n"
+#define MSG_JOBFILE "error: couldn't read job file\n"
+#define MSG_OK "ok\n"
+#define MSG_JOB_STATUS "job %d %s: %s"
+#define MSG_JOBS "%d job(s), %d failed\n"
+#define MSG_SHM "error: couldn't create shared memory segment\n"
+#define MSG_SHM_EXISTS "error: shared memory segment already exists, remove "\
+"it from /dev/shm if no run uses it\n"
+#define MSG_SOCKET "error: couldn't listen on socket\n"
+#define MSG_SERVE "serving on %s with %d worker(s)\n"
+#define MSG_LATENCY "%llu request(s), %llu failed, p50 %llu us, p99 %llu us\n"
+#define MSG_SHOTFILE "error: couldn't read shot file\n"
+#define MSG_SHOT "shot %d: error: invalid shot line\n"
+#define MSG_SWEEP "%llu cell(s)\n"
+#define MSG_SOLVE_HEADER "x,y,speed,low_angle,low_time,high_angle,high_time,"\
+"min_speed,min_angle,min_time\n"
+#define MSG_SWEEP_HEADER "angle,speed,wind_angle,wind_force,gravitation,"\
+"range,apex,flight_time,impact_x,impact_y,exit\n"
+#define MSG_SAMPLES "trajectory: %d samples\n"
+#define MSG_FRAMES "animation: %d frames\n"
+#define MSG_CACHE "cache: %llu hit(s), %llu miss(es), hit rate %.1f%%, "\
+"%llu eviction(s), %llu byte(s) in %d entrie(s)\n"
+#define MSG_STATS "lines: %llu pixels filled, square brush would write %llu "\
+"(overdraw %.2f)\n"
 
 
 #define TYPE 19778
 #define BITS_PER_PIXEL 24
 #define PLANES 1
 #define COMPRESSION 0
+#define BI_RLE8 1
+#define BI_RLE4 2
 #define X_PIXEL_PER_METER 0x130B //2835 , 72 DPI
 #define Y_PIXEL_PER_METER 0x130B //2835 , 72 DPI
 #define LINE_STRENGTH 5
+#define PRIM_BACKGROUND 0
+#define PRIM_RECTANGLE 1
+#define PRIM_LINE 2
+#define PRIM_PARABOLA 3
+#define PRIM_FLIGHT 4
+#define DRAW_POLYLINE 0
+#define DRAW_PARABOLA 1
+#define DRAW_FUSED 2
+#define FLIGHT_SPANS 4096
+#define FLIGHT_BLOCK 256
+#define EXIT_NONE 0
+#define EXIT_LEFT 1
+#define EXIT_RIGHT 2
+#define EXIT_BOTTOM 3
+#define EXIT_TOP 4
+#define SWEEP_FIELDS 5
+#define SWEEP_CHUNK 4096
+#define RECORD_CSV 0
+#define RECORD_BINARY 1
+#define SCENE_SHAPES 8
+#define SCENE_CHUNK 64
+#define PALETTE_SIZE 256
+#define LAYER_SLOTS 8
+#define LAYER_COLORS 16
+#define LAYER_CACHE_SIZE (256 << 20)
+#define LAYER_MAGIC "ASSALYR1"
+#define CACHE_VERSION 2
+#define CACHE_SIZE 1024
+#define CACHE_TEMP_AGE 3600
+#define LATENCY_BUCKETS 320
+#define REQUEST_SIZE 65536
+#define CONNECTION_IDLE 0
+#define CONNECTION_READY 1
+#define CONNECTION_BUSY 2
+#define SHM_MAGIC "ASSASHM1"
+#define SHM_SLOTS 4
+#define SHM_BITMAP_OFFSET 64
+#define ANIMATE_Y4M 1
+#define ANIMATE_PPM 2
+#define ANIMATE_BMP 3
+#define FORMAT_BMP24 0
+#define FORMAT_BMP8 1
+#define FORMAT_BMP4 2
+#define FORMAT_RLE8 3
+#define FORMAT_RLE4 4
+#define FORMAT_PNG 5
+#define FORMAT_SVG 6
+#define PNG_WINDOW 32768
+#define PNG_LOOKAHEAD 262
+#define PNG_HASH_BITS 15
+#define PNG_CHUNK 65536
 
 
 #pragma pack(push,1)
@@ -50,6 +176,7 @@ typedef struct
   float wind_force;
   float v_angle;
   float v_speed;
+  float tolerance;
 } Parameter;
 
 typedef struct
@@ -83,24 +210,566 @@ typedef struct
 } BitMap;
 #pragma pack(pop)
 
+// Row-major array of palette indices, one byte per pixel, rows stored
+// bottom-up and padded to a multiple of 4 bytes as in an 8 bit BMP. Only the
+// band of rows y_offset to y_offset + rows - 1 of the image is held in
+// memory. With colors set the pixels are those of a 24 bit BMP instead and
+// indices are written as the colors they stand for, with plane_size set the
+// three bytes of a color go to three planes of that size. top_down stores
+// the rows the other way round, as PPM and Y4M frames do.
+typedef struct
+{
+  uint8_t *pixels;
+  uint32_t *colors;
+  size_t plane_size;
+  int top_down;
+  int width;
+  int height;
+  int stride;
+  int y_offset;
+  int rows;
+  size_t capacity;
+} FrameBuffer;
+
+// Velocity, wind and gravitation of a shot in pixels and seconds
+typedef struct
+{
+  float v_x;
+  float v_y;
+  float w_x;
+  float w_y;
+  float g;
+} Motion;
+
+// A flight as the parabola start + v t + a t^2/2 for t from 0 to t_exit
+typedef struct
+{
+  double x;
+  double y;
+  double v_x;
+  double v_y;
+  double a_x;
+  double a_y;
+  double t_exit;
+} Curve;
+
+// Cursor over the samples of a shot as calculation() takes them, so that
+// they can be generated one at a time instead of being stored
+typedef struct
+{
+  Motion motion;
+  int x;
+  int y;
+  float step;
+  float tolerance;
+  double t_exit;
+  double t;
+  int count;
+  int index;
+} Flight;
+
+// One drawing operation of the scene together with the rows it can touch,
+// lines and rectangles take their coordinates from points[0] and points[1],
+// parabolas from curve and sampled flights from flight
+typedef struct
+{
+  int type;
+  int color;
+  int index;
+  int str;
+  int point_count;
+  int *points[2];
+  Curve *curve;
+  Flight *flight;
+  int y_min;
+  int y_max;
+} Primitive;
+
+// The colors of a scene as 0xRRGGBB, which is BGR0 in memory. blue, green
+// and red hold the first 16 of them split up for the vectorized lookup.
+typedef struct
+{
+  int count;
+  uint32_t colors[PALETTE_SIZE];
+  uint8_t blue[16];
+  uint8_t green[16];
+  uint8_t red[16];
+} Palette;
+
+// Everything drawn in a bitmap, in drawing order. The points of the cannon
+// parts are kept in the scene, the trajectory is referenced in chunks of
+// SCENE_CHUNK segments so that each chunk gets its own bounding rows. The
+// first layer_count primitives, using layer_colors colors, are the static
+// layer of background and cannon; drawing starts at first, the primitives
+// before it being in the frame already.
+typedef struct
+{
+  Primitive *primitives;
+  int count;
+  int capacity;
+  int first;
+  int layer_count;
+  int layer_colors;
+  int shapes;
+  int shape_points[2][SCENE_SHAPES];
+  Curve curve;
+  Flight flight;
+  Palette palette;
+} Scene;
+
+typedef struct
+{
+  int y;
+  int x_from;
+  int x_to;
+} Span;
+
+typedef struct
+{
+  uint64_t filled_pixels;
+  uint64_t brush_pixels;
+} LineStats;
+
+// Row spans covered by lines of one color, collected so that overlapping
+// spans are merged and every pixel is filled only once
+typedef struct
+{
+  Span *spans;
+  int count;
+  int capacity;
+  LineStats stats;
+} SpanList;
+
+// A line segment walked the way the square brush walks it: one brush
+// position per pixel along the major axis, the end point excluded. Only the
+// steps first_step to last_step are left after clipping.
+typedef struct
+{
+  int x;
+  int y;
+  int x_dif;
+  int y_dif;
+  int steps;
+  int change;
+  int y_major;
+  int y_direction;
+  int first_step;
+  int last_step;
+} Segment;
+
+// Leftmost and rightmost pixel of a walked path in the rows first_row to
+// first_row + rows - 1
+typedef struct
+{
+  int *x_min;
+  int *x_max;
+  int first_row;
+  int rows;
+  int capacity;
+} PathRows;
+
+// Rows y_offset to y_offset + rows - 1 of a frame drawn by one thread with
+// the primitives listed in bin
+typedef struct
+{
+  Scene *scene;
+  FrameBuffer frame;
+  int *bin;
+  int bin_count;
+  SpanList spans;
+  PathRows path;
+  int status;
+} Band;
+
+// Per worker storage, kept alive between renders so that a batch allocates
+// its point arrays, scene and pixels only once
+typedef struct
+{
+  int *points[2];
+  int point_capacity;
+  int point_count;
+  Curve curve;
+  Flight flight;
+  Scene scene;
+  FrameBuffer frame;
+  LineStats line_stats;
+} RenderContext;
+
+// Growing block of memory for encoded output
+typedef struct
+{
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+} ByteBuffer;
+
+// Zlib stream of PNG scanlines written out in IDAT chunks as it grows. The
+// window holds the last 64 KiB of uncompressed data, positions count from
+// the start of the stream.
+typedef struct
+{
+  FILE *fp;
+  int level;
+  int row_bytes;
+  uint8_t *window;
+  size_t window_pos;
+  size_t pos;
+  size_t end;
+  int64_t *head;
+  int64_t *prev;
+  uint64_t bits;
+  int bit_count;
+  ByteBuffer chunk;
+  uint32_t adler_a;
+  uint32_t adler_b;
+  uint32_t crc_table[256];
+} PngStream;
+
+// Where the rendered rows go: a stream in the output format, or the pixel
+// array of the mapped bitmap file
+typedef struct
+{
+  int format;
+  FILE *fp;
+  uint8_t *map;
+  size_t map_size;
+  uint8_t *pixels;
+  uint8_t *row;
+  ByteBuffer rle;
+  int patch;
+  uint64_t encoded;
+  PngStream png;
+} Output;
+
+// Start of the shared memory segment, the slots follow at data_offset and
+// every slot_size bytes. Job n for the ring goes to slot n % slot_count,
+// where it can be written once the consumer has counted job n - slot_count
+// as consumed.
+typedef struct
+{
+  char magic[8];
+  uint32_t slot_count;
+  uint32_t consumed;
+  uint64_t slot_size;
+  uint64_t data_offset;
+} ShmHeader;
+
+// A slot holds the bitmap file at SHM_BITMAP_OFFSET. sequence becomes n + 1
+// once job n is done. Every job writing to "-" takes a slot, a failed one
+// has a status and size 0, and size 0 with status 0 ends the stream. job is
+// the line of a batch job (1 otherwise), as the workers of a batch take
+// their slots in the order they get to them.
+typedef struct
+{
+  uint32_t sequence;
+  uint32_t status;
+  uint64_t size;
+  float v_angle;
+  float v_speed;
+  uint32_t job;
+} ShmSlot;
+
+typedef struct
+{
+  ShmHeader *header;
+  size_t size;
+  uint32_t next;
+  pthread_mutex_t lock;
+} ShmRing;
+
+// Background and cannon rasterized as palette indices, as the rows of an 8
+// bit bitmap. They only depend on the resolution and the angle, so renders
+// at the same ones copy them instead of drawing them. pixels points into
+// map when the layer was read from a blob.
+typedef struct
+{
+  int width;
+  int height;
+  float v_angle;
+  int stride;
+  int colors;
+  uint32_t palette[LAYER_COLORS];
+  uint8_t *pixels;
+  uint8_t *map;
+  size_t map_size;
+  int refs;
+  int cached;
+  uint64_t used;
+} Layer;
+
+// The most recently used layers, shared by the threads of a batch, of at
+// most LAYER_CACHE_SIZE bytes. Layers are only evicted while unused. With
+// dir set they are also kept on disk between runs.
+typedef struct
+{
+  Layer *layers[LAYER_SLOTS];
+  int count;
+  size_t size;
+  uint64_t tick;
+  char *dir;
+  pthread_mutex_t lock;
+} LayerCache;
+
+// What a layer blob starts with, followed by height rows of stride bytes
+typedef struct
+{
+  char magic[8];
+  uint32_t width;
+  uint32_t height;
+  float v_angle;
+  uint32_t stride;
+  uint32_t colors;
+  uint32_t palette[LAYER_COLORS];
+} LayerHeader;
+
+// Encoded output collected in memory instead of going to output_fd
+typedef struct
+{
+  char *data;
+  size_t size;
+} MemoryOutput;
+
+// Counters of a result cache directory, shared by all runs using it.
+// entries and bytes are kept up to date by the misses and set right by a
+// scan of the directory.
+typedef struct
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t bytes;
+  int entries;
+} CacheStats;
+
+// A result in the cache directory, for the eviction by last use
+typedef struct
+{
+  char *name;
+  time_t used;
+  uint64_t size;
+} CacheEntry;
+
+typedef struct
+{
+  char *batch_name;
+  int workers;
+  int band_rows;
+  int threads;
+  int stats;
+  int draw;
+  int composite;
+  int format;
+  int level;
+  int map;
+  char *sweep;
+  int record;
+  char *solve;
+  char *solve_batch;
+  char *overlay;
+  int animate;
+  char *layer_dir;
+  LayerCache *layers;
+  char *cache_dir;
+  uint64_t cache_size;
+  char *serve;
+  MemoryOutput *memory;
+  char *shm_name;
+  int shm_slots;
+  uint64_t shm_slot_size;
+  ShmRing *ring;
+  ShmSlot *slot;
+  uint32_t sequence;
+  int output_fd;
+} Options;
+
+typedef struct
+{
+  FILE *job_file;
+  Parameter *defaults;
+  Options *options;
+  pthread_mutex_t lock;
+  pthread_mutex_t output_lock;
+  int line_number;
+  int jobs;
+  int failed;
+} Batch;
+
+// One flight of an overlay in its color, with its own samples, curve or
+// sample cursor depending on how it is drawn
+typedef struct
+{
+  Parameter params;
+  int color;
+  int *points[2];
+  int count;
+  Curve curve;
+  Flight flight;
+  int status;
+} Shot;
+
+// The shots drawn into one image. They are simulated by several threads,
+// each taking the next shot under the lock.
+typedef struct
+{
+  Shot *shots;
+  int count;
+  int capacity;
+  int next;
+  int draw;
+  pthread_mutex_t lock;
+} Overlay;
+
+// Request latencies in log-linear buckets: exact below 8 us, then 8 buckets
+// per power of two, which bounds the error of a percentile to 12.5%
+typedef struct
+{
+  uint64_t buckets[LATENCY_BUCKETS];
+  uint64_t count;
+  uint64_t failed;
+  pthread_mutex_t lock;
+} Latency;
+
+// A client of the daemon with the bytes read but not served yet. An idle
+// one is polled, a ready one has data and waits for a worker since ticket,
+// a busy one is served by exactly one worker.
+typedef struct
+{
+  int fd;
+  int state;
+  uint64_t ticket;
+  char *buffer;
+  size_t size;
+  size_t capacity;
+} Connection;
+
+// A render daemon: one thread polls the socket and the idle connections,
+// the workers take the ready ones in arrival order and keep their render
+// contexts warm between requests. A worker hands its connection back
+// through the wake pipe once its complete requests are answered.
+typedef struct
+{
+  int listen_fd;
+  int wake_fds[2];
+  Parameter *defaults;
+  Options *options;
+  Connection **connections;
+  int count;
+  int capacity;
+  uint64_t tickets;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  Latency latency;
+} Server;
+
+// The values from, from + step, ... of one swept field
+typedef struct
+{
+  float from;
+  float step;
+  int count;
+} SweepRange;
+
+// A grid of shots over angle, speed, wind angle, wind force and
+// gravitation. Workers take chunks of SWEEP_CHUNK cells and write them out
+// in order, waiting for the chunks before theirs.
+typedef struct
+{
+  Parameter *defaults;
+  SweepRange ranges[SWEEP_FIELDS];
+  uint64_t cells;
+  uint64_t next_chunk;
+  uint64_t written_chunk;
+  int record;
+  FILE *fp;
+  pthread_mutex_t lock;
+  pthread_cond_t written;
+} Sweep;
+
+// Flight of one sweep cell, also the layout of binary records. Range and
+// apex are meters from the start, the impact is the pixel position at which
+// the shot leaves the bitmap.
+typedef struct
+{
+  float angle;
+  float speed;
+  float wind_angle;
+  float wind_force;
+  float gravitation;
+  float range;
+  float apex;
+  float flight_time;
+  float impact_x;
+  float impact_y;
+  int32_t exit_side;
+} SweepRecord;
+
+// Firing solutions for a target pixel: the angles at which the given speed
+// (m/s) hits it, low being the shorter flight, and the smallest speed that
+// reaches it at all with its angle. Angles are in degrees as on the command
+// line, times in seconds, NAN where there is no solution.
+typedef struct
+{
+  double x;
+  double y;
+  double speed;
+  double low_angle;
+  double low_time;
+  double high_angle;
+  double high_time;
+  double min_speed;
+  double min_angle;
+  double min_time;
+} Solution;
 
-BitMap* createHeader(Parameter *params, BitMap *pbitmap)
+
+int rowStride(int width, int bits_per_pixel)
+{
+  return ((uint64_t) width * bits_per_pixel + 31) / 32 * 4;
+}
+
+int formatBits(int format)
 {
-  int pixel_byte_size = params->height * params->width * BITS_PER_PIXEL/8;
-  int file_size = pixel_byte_size + sizeof(BitMap);
+  if(format == FORMAT_BMP24)
+    return BITS_PER_PIXEL;
+  return (format == FORMAT_BMP4 || format == FORMAT_RLE4) ? 4 : 8;
+}
+
+// Header for the output format with a palette of colors entries between
+// header and pixels. The image size of compressed formats is only known
+// after encoding and has to be filled in by the caller.
+BitMap* createHeader(Parameter *params, int format, int colors,
+    BitMap *pbitmap)
+{
+  uint64_t pixel_byte_size = (uint64_t) params->height *
+      rowStride(params->width, formatBits(format));
+  uint64_t file_size = 0;
+
+  if(format == FORMAT_BMP24)
+    colors = 0;
+  if(format == FORMAT_RLE8 || format == FORMAT_RLE4)
+    pixel_byte_size = 0;
+  file_size = pixel_byte_size + sizeof(BitMap) + 4 * colors;
+
+  // sizes beyond 4 GiB can't be stored, 0 is allowed for uncompressed data
+  if(file_size > UINT32_MAX)
+  {
+    pixel_byte_size = 0;
+    file_size = 0;
+  }
   pbitmap->file_header.signature = TYPE;
   pbitmap->file_header.file_size = file_size;
-  pbitmap->file_header.fileoffset_to_pixelarray = sizeof(BitMap);
+  pbitmap->file_header.fileoffset_to_pixelarray = sizeof(BitMap) + 4 * colors;
   pbitmap->bit_map_info_header.dib_header_size = sizeof(BitMapInfoHeader);
   pbitmap->bit_map_info_header.width = params->width;
   pbitmap->bit_map_info_header.height = params->height;
   pbitmap->bit_map_info_header.planes = PLANES;
-  pbitmap->bit_map_info_header.bits_per_pixel = BITS_PER_PIXEL;
-  pbitmap->bit_map_info_header.compression = COMPRESSION;
+  pbitmap->bit_map_info_header.bits_per_pixel = formatBits(format);
+  pbitmap->bit_map_info_header.compression = (format == FORMAT_RLE8) ?
+      BI_RLE8 : (format == FORMAT_RLE4) ? BI_RLE4 : COMPRESSION;
   pbitmap->bit_map_info_header.image_size = pixel_byte_size;
   pbitmap->bit_map_info_header.y_pixel_per_meter = Y_PIXEL_PER_METER;
   pbitmap->bit_map_info_header.x_pixel_per_meter = X_PIXEL_PER_METER;
-  pbitmap->bit_map_info_header.num_colors_pallette = 0;
+  pbitmap->bit_map_info_header.num_colors_pallette = colors;
   return pbitmap;
 }
 
@@ -118,6 +787,7 @@ int readConfig(char *file_name, Parameter *params)
   int unused_res = 1;
   int unused_pps = 1;
   int unused_grav = 1;
+  int unused_tol = 1;
   float prop = 0;
   int errors = 0;
   while(!feof(cfile))
@@ -185,8 +855,21 @@ int readConfig(char *file_name, Parameter *params)
         errors++;
       unused_grav = 0;
     }
+    else if(strcmp(propname, "tolerance") == 0 && unused_tol)
+    {
+      // optional, switches from pps to adaptive sampling
+      if(!feof(cfile) && fscanf(cfile, "%f", &prop) != 0 && prop >= 0)
+      {
+        params->tolerance = prop;
+        printf("tolerance set to %.2f pixels\n", params->tolerance);
+      }
+      else
+        errors++;
+      unused_tol = 0;
+    }
   }
-  errors = errors + unused_grav + unused_pps + unused_res + unused_wind;
+  errors = errors + unused_grav + (unused_pps && unused_tol) + unused_res +
+      unused_wind;
   if(errors)
     printf("%d missing or incorrect entrie(s) - using default values\n",
         errors);
@@ -194,186 +877,327 @@ int readConfig(char *file_name, Parameter *params)
   return 0;
 }
 
-int drawBackground(int color, Parameter *params,
-    int (*pixel_buffer)[params->height])
+FrameBuffer* resizeFrameBuffer(Parameter *params, int rows,
+    FrameBuffer *frame)
+{
+  size_t size = (size_t) rows * rowStride(params->width, 8);
+  uint8_t *pixels = NULL;
+
+  if(size > frame->capacity)
+  {
+    if((pixels = (uint8_t *) realloc(frame->pixels, size)) == NULL)
+      return NULL;
+    frame->pixels = pixels;
+    frame->capacity = size;
+  }
+  frame->width = params->width;
+  frame->height = params->height;
+  frame->stride = rowStride(params->width, 8);
+  frame->y_offset = 0;
+  frame->rows = rows;
+  return frame;
+}
+
+void freeFrameBuffer(FrameBuffer *frame)
+{
+  free(frame->pixels);
+  frame->pixels = NULL;
+  frame->capacity = 0;
+}
+
+void fillSpan(FrameBuffer *frame, int y, int x_from, int x_to, int index)
 {
+  uint8_t *row = NULL;
+  int plane = 0;
+
+  y -= frame->y_offset;
+  if(y < 0 || y >= frame->rows)
+    return;
+  if(x_from < 0)
+    x_from = 0;
+  if(x_to >= frame->width)
+    x_to = frame->width - 1;
+  if(x_from > x_to)
+    return;
+  row = frame->pixels + (size_t) (frame->top_down ? frame->rows - 1 - y : y) *
+      frame->stride;
+  if(frame->colors == NULL)
+  {
+    memset(row + x_from, index, x_to - x_from + 1);
+    return;
+  }
+  if(frame->plane_size)
+  {
+    for(plane = 0; plane < 3; plane++)
+      memset(row + plane * frame->plane_size + x_from,
+          (frame->colors[index] >> (plane * 8)) & 0xFF, x_to - x_from + 1);
+    return;
+  }
+  for(; x_from <= x_to; x_from++)
+    memcpy(row + x_from * 3, &frame->colors[index], 3);
+}
 
+int drawBackground(int index, FrameBuffer *frame)
+{
   int curheight = 0;
-  int curwidth = 0;
 
-  for(curwidth = 0; curwidth < params->width; curwidth++)
-    for(curheight = 0; curheight < params->height; curheight++)
-      pixel_buffer[curwidth][curheight] = color;
+  // planes don't follow each other in rows, so every row is filled
+  if(frame->plane_size)
+  {
+    for(curheight = 0; curheight < frame->rows; curheight++)
+      fillSpan(frame, frame->y_offset + curheight, 0, frame->width - 1,
+          index);
+    return 0;
+  }
+  // the row padding is written out as is in 8 bit bitmaps, the first row
+  // in memory is filled and copied to the others
+  memset(frame->pixels + frame->width, 0, frame->stride - frame->width);
+  fillSpan(frame, frame->top_down ? frame->y_offset + frame->rows - 1 :
+      frame->y_offset, 0, frame->width - 1, index);
+  for(curheight = 1; curheight < frame->rows; curheight++)
+    memcpy(frame->pixels + (size_t) curheight * frame->stride, frame->pixels,
+        frame->stride);
   return 0;
 }
 
-int drawLine(int **points, int point_count, int str, int color,
-    Parameter *params, int (*pixel_buffer)[params->height])
+Segment* setSegment(int **points, int cur_point, Segment *segment)
 {
-  int cur_point = 0;
-  int cur_line = 0;
-  int x_str = 0;
-  int y_str = 0;
-  int x_dif = 0;
-  int y_dif = 0;
-  int x_poi = 0;
-  int y_poi = 0;
-  int change = 0;
+  segment->x = points[0][cur_point];
+  segment->y = points[1][cur_point];
+  segment->x_dif = points[0][cur_point+1] - segment->x;
+  segment->y_dif = points[1][cur_point+1] - segment->y;
+  segment->y_major = (long long) segment->y_dif * segment->y_dif >=
+      (long long) segment->x_dif * segment->x_dif;
+  segment->steps = abs(segment->y_major ? segment->y_dif : segment->x_dif);
+  segment->change = ((segment->y_major ? segment->y_dif : segment->x_dif) < 0)
+      ? -1 : 1;
+  segment->y_direction = (segment->y_dif < 0) ? -1 : 1;
+  segment->first_step = 0;
+  segment->last_step = segment->steps - 1;
+  return segment;
+}
 
-  if(!str)
-    str = LINE_STRENGTH;
+// Liang-Barsky: narrows the part t_from to t_to of the segment
+// start + t * dif to the part inside the boundaries low to high
+int clipAxis(double start, double dif, double low, double high,
+    double *t_from, double *t_to)
+{
+  double t_low = 0;
+  double t_high = 0;
 
-  for(cur_point = 0; cur_point < point_count-1; cur_point++)
+  if(dif == 0)
+    return start >= low && start <= high;
+  t_low = (low - start) / dif;
+  t_high = (high - start) / dif;
+  if(t_low > t_high)
   {
-    x_dif = (points[0][cur_point+1] - points[0][cur_point]);
-    y_dif = (points[1][cur_point+1] - points[1][cur_point]);
-    if((y_dif*y_dif) >= (x_dif*x_dif))
-    {
-      change = (y_dif < 0) ? -1 : 1;
-      for(cur_line = 0; cur_line != y_dif; (cur_line += change))
-        for(x_str = 0; x_str < str; x_str++)
-        {
-          x_poi = points[0][cur_point] + ((x_dif*cur_line)/y_dif) - str/2 +
-              x_str;
-          for(y_str = 0; y_str < str; y_str++)
-          {
-            y_poi = points[1][cur_point] + cur_line - str/2 + y_str;
-            if(!(y_poi < 0 || y_poi > params->height || x_poi < 0 ||
-                x_poi > params->width))
-            {
-              pixel_buffer[x_poi][y_poi] = color;
-            }
-          }
-        }
-    }
+    t_high = t_low;
+    t_low = (high - start) / dif;
+  }
+  if(t_low > *t_from)
+    *t_from = t_low;
+  if(t_high < *t_to)
+    *t_to = t_high;
+  return *t_from <= *t_to;
+}
+
+// Restricts the steps of the segment to those whose brush can reach into
+// the frame, the frame being widened by the brush and one more pixel for
+// the truncated minor axis. Returns 0 if the segment misses the frame.
+int clipSegment(Segment *segment, int str, FrameBuffer *frame)
+{
+  double t_from = 0;
+  double t_to = 1;
+
+  if(!clipAxis(segment->x, segment->x_dif, str/2 - str,
+      frame->width + str/2, &t_from, &t_to) ||
+      !clipAxis(segment->y, segment->y_dif, frame->y_offset + str/2 - str,
+      frame->y_offset + frame->rows + str/2, &t_from, &t_to))
+    return 0;
+  if(t_from * segment->steps > segment->first_step)
+    segment->first_step = floor(t_from * segment->steps);
+  if(t_to * segment->steps < segment->last_step)
+    segment->last_step = ceil(t_to * segment->steps);
+  return segment->first_step <= segment->last_step;
+}
+
+int brushX(Segment *segment, int step)
+{
+  if(!segment->y_major)
+    return segment->x + segment->change * step;
+  return segment->x + ((long long) segment->x_dif * segment->change * step) /
+      segment->y_dif;
+}
+
+int brushY(Segment *segment, int step)
+{
+  if(segment->y_major)
+    return segment->y + segment->change * step;
+  return segment->y + ((long long) segment->y_dif * segment->change * step) /
+      segment->x_dif;
+}
+
+// brushY() * y_direction never decreases along the segment, so the first
+// step reaching a bound is found by bisection
+int firstStep(Segment *segment, int bound)
+{
+  int low = segment->first_step;
+  int high = segment->last_step + 1;
+  int middle = 0;
+
+  while(low < high)
+  {
+    middle = low + (high - low) / 2;
+    if(segment->y_direction * brushY(segment, middle) >= bound)
+      high = middle;
     else
-    {
-      change = (x_dif < 0) ? -1 : 1;
-      for(cur_line = 0; cur_line != x_dif; (cur_line += change))
-        for(y_str = 0; y_str < str; y_str++)
-        {
-          y_poi = points[1][cur_point] + ((y_dif*cur_line)/x_dif) - str/2 +
-              y_str;
-          for(x_str = 0; x_str < str; x_str++)
-          {
-            x_poi = points[0][cur_point] + cur_line - str/2 + x_str;
-            if(!(y_poi < 0 || y_poi > params->height || x_poi < 0 ||
-                x_poi > params->width))
-            {
-              pixel_buffer[x_poi][y_poi] = color;
-            }
-          }
-        }
-    }
+      low = middle + 1;
   }
+  return low;
+}
+
+int addSpan(SpanList *list, int y, int x_from, int x_to)
+{
+  Span *spans = NULL;
 
+  if(list->count == list->capacity)
+  {
+    if((spans = (Span *) realloc(list->spans, sizeof(Span) *
+        (list->capacity ? list->capacity * 2 : 256))) == NULL)
+      return 2;
+    list->spans = spans;
+    list->capacity = list->capacity ? list->capacity * 2 : 256;
+  }
+  list->spans[list->count].y = y;
+  list->spans[list->count].x_from = x_from;
+  list->spans[list->count].x_to = x_to;
+  list->count++;
   return 0;
 }
 
-int drawRectangle(int **points, int color, Parameter *params,
-    int (*pixel_buffer)[params->height])
+// Adds the spans a str x str square brush covers in every row of the frame
+// when moved along the line. The brush positions covering a row form one
+// run of steps, whose first and last position give the span of the row.
+int addLineSpans(int **points, int point_count, int str, FrameBuffer *frame,
+    SpanList *list)
 {
-  int curwidth = 0;
+  Segment segment;
+  int cur_point = 0;
   int curheight = 0;
-  int changewidth = 0;
-  int changeheight = 0;
-
-  changewidth = (points[0][0] > points[0][1]) ? -1 : 1;
-  changeheight = (points[1][0] > points[1][1]) ? -1 : 1;
+  int lastheight = 0;
+  int first_step = 0;
+  int last_step = 0;
+  int x_from = 0;
+  int x_to = 0;
 
-  for(curheight = points[1][0]; curheight != (points[1][1] + changeheight);
-      curheight += changeheight)
+  for(cur_point = 0; cur_point < point_count-1; cur_point++)
   {
-    for(curwidth = points[0][0]; curwidth != (points[0][1] + changewidth);
-        curwidth += changewidth)
+    if(setSegment(points, cur_point, &segment)->steps == 0 ||
+        !clipSegment(&segment, str, frame))
+      continue;
+    curheight = brushY(&segment, segment.first_step);
+    lastheight = brushY(&segment, segment.last_step);
+    if(curheight > lastheight)
+    {
+      curheight = lastheight;
+      lastheight = brushY(&segment, segment.first_step);
+    }
+    curheight -= str/2;
+    lastheight += str - str/2 - 1;
+    if(curheight < frame->y_offset)
+      curheight = frame->y_offset;
+    if(lastheight >= frame->y_offset + frame->rows)
+      lastheight = frame->y_offset + frame->rows - 1;
+
+    for(; curheight <= lastheight; curheight++)
     {
-      if(!(curheight < 0 || curheight >= params->height || curwidth < 0 ||
-          curwidth >= params->width))
+      // steps whose brush center is within curheight + str/2 - str + 1
+      // and curheight + str/2
+      if(segment.y_direction > 0)
       {
-        pixel_buffer[curwidth][curheight] = color;
+        first_step = firstStep(&segment, curheight + str/2 - str + 1);
+        last_step = firstStep(&segment, curheight + str/2 + 1) - 1;
       }
-
+      else
+      {
+        first_step = firstStep(&segment, -(curheight + str/2));
+        last_step = firstStep(&segment, -(curheight + str/2 - str + 1) + 1)
+            - 1;
+      }
+      if(first_step > last_step)
+        continue;
+      x_from = brushX(&segment, first_step);
+      x_to = brushX(&segment, last_step);
+      if(x_from > x_to)
+      {
+        x_to = x_from;
+        x_from = brushX(&segment, last_step);
+      }
+      if(addSpan(list, curheight, x_from - str/2, x_to - str/2 + str - 1))
+        return 2;
+      list->stats.brush_pixels += (uint64_t) (last_step - first_step + 1) *
+          str;
     }
-
   }
   return 0;
 }
 
-int drawCannon(Parameter *params, int (*pixel_buffer)[params->height])
+int compareSpans(const void *first, const void *second)
 {
+  const Span *span_a = (const Span *) first;
+  const Span *span_b = (const Span *) second;
 
-  int **points;
-  points = (int **) malloc(sizeof(int) * 4);
-  points[0] = (int *)realloc(NULL, sizeof(int)*2);
-  points[1] = (int *)realloc(NULL, sizeof(int)*2);
-  points[0][0] = 0;
-  points[0][1] = params->width;
-  points[1][0] = params->width/2 - cos((90 - params->v_angle) / 57.2957795) *
-      params->width/12;
-  points[1][1] = 0;
-  drawRectangle(points, 0x005000, params, pixel_buffer);
-  points[0][1] = params->width/2;
-  points[1][1] = params->height/2;
-
-  points[0][0] = points[0][1] - cos(params->v_angle / 57.2957795) *
-      params->width/8;
-  points[1][0] = points[1][1] - cos((90 - params->v_angle) / 57.2957795) *
-      params->width/8;
-  drawLine(points, 2, (params->width/24), 0xA0A0A0, params, pixel_buffer);
-  points[1][1] = points[1][0] - params->width/24;
-  points[0][0] = points[0][0] - params->width/32;
-  points[0][1] = points[0][1] + params->width/32;
-
-  drawRectangle(points, 0x705000, params, pixel_buffer);
-  points[0][0] = params->width/2 + cos((90 - params->v_angle) / 57.2957795) *
-      params->width/38;
-  points[1][0] = params->height/2 - cos(params->v_angle / 57.2957795) *
-      params->height/64;
-  points[0][1] = params->width/2 - cos((90 - params->v_angle) / 57.2957795) *
-      params->width/48;
-  points[1][1] = params->height/2 + cos(params->v_angle / 57.2957795) *
-      params->height/24;
-  drawLine(points, 2, (params->width/48), 0xA0A0A0, params, pixel_buffer);
-
-
+  if(span_a->y != span_b->y)
+    return (span_a->y < span_b->y) ? -1 : 1;
+  if(span_a->x_from != span_b->x_from)
+    return (span_a->x_from < span_b->x_from) ? -1 : 1;
   return 0;
 }
 
-int drawBitMap(char *bmp_name, int **points, int *counter, Parameter *params)
+// Merges overlapping spans of the list and fills each covered pixel once
+void fillSpans(SpanList *list, int index, FrameBuffer *frame)
 {
+  Span current;
+  int cur_span = 0;
+  int x_from = 0;
+  int x_to = 0;
 
-  int curheight = 0;
-  int curwidth = 0;
-  int pixel_buffer[params->width][params->height];
-  FILE *fp = NULL;
-  if((fp = fopen(bmp_name, "wb")) == NULL)
-  {
-    //Could not write file
-    printf(MSG_WRITE);
-    return 3;
-
-  }
-  BitMap *bmap;
-  if((bmap = (BitMap*) calloc(1, sizeof(BitMap))) == NULL)
+  if(!list->count)
+    return;
+  qsort(list->spans, list->count, sizeof(Span), compareSpans);
+  current = list->spans[0];
+  for(cur_span = 1; cur_span <= list->count; cur_span++)
   {
-    printf(MSG_OOM);
-    return 2;
+    if(cur_span < list->count && list->spans[cur_span].y == current.y &&
+        list->spans[cur_span].x_from <= current.x_to + 1)
+    {
+      if(list->spans[cur_span].x_to > current.x_to)
+        current.x_to = list->spans[cur_span].x_to;
+      continue;
+    }
+    x_from = (current.x_from < 0) ? 0 : current.x_from;
+    x_to = (current.x_to >= frame->width) ? frame->width - 1 : current.x_to;
+    if(x_from <= x_to)
+      list->stats.filled_pixels += x_to - x_from + 1;
+    fillSpan(frame, current.y, current.x_from, current.x_to, index);
+    if(cur_span < list->count)
+      current = list->spans[cur_span];
   }
-  createHeader(params, bmap);
-  fwrite(bmap, 1, sizeof(BitMap), fp);
-  free(bmap);
-  drawBackground(0x60D0FF, params, pixel_buffer);
-  drawCannon(params, pixel_buffer);
-  drawLine(points, *counter, 0, 0xFF0000, params, pixel_buffer);
+  list->count = 0;
+}
 
-  for(curheight = 0; curheight < params->height; curheight++)
-    for(curwidth = 0; curwidth < params->width; curwidth++)
-      fwrite( &pixel_buffer[curwidth][curheight], 3, 1, fp);
-  fclose(fp);
+int drawLine(int **points, int point_count, int str, int index,
+    FrameBuffer *frame, SpanList *list)
+{
+  if(!str)
+    str = LINE_STRENGTH;
+  if(addLineSpans(points, point_count, str, frame, list) != 0)
+    return 2;
+  fillSpans(list, index, frame);
   return 0;
 }
 
-int calculation(int **points, int *counter, Parameter *params)
+Motion* setMotion(Parameter *params, Motion *motion)
 {
   // (first argument = float winkel, second argument = float speed) = velocity vector = v
   // cfg-file: BitMap size, pps = unsigned int pixel per second, float gravitation, float wind_force, float wind_angle
@@ -384,118 +1208,4912 @@ int calculation(int **points, int *counter, Parameter *params)
   //force und speed sind in meter angegeben, müssen durch 10 dividiert werden, damit pixel
   float wind_force_pxl = params->wind_force / 10;
   float v_force_pxl = params->v_speed / 10;
-  float v_x = (v_force_pxl * cos(params->v_angle / 57.2957795));
-  float v_y = (v_force_pxl * cos((90 - params->v_angle) / 57.2957795));
-  float p = 1/(float)params->pps;
-  float t = p;
-  float g = -params->gravitation/10;
-  float w_x = (wind_force_pxl * cos(params->wind_angle/ 57.2957795));
-  float w_y = (wind_force_pxl * cos((90 - params->wind_angle)/ 57.2957795));
-  int cur_x = 1;
+  motion->v_x = (v_force_pxl * cos(params->v_angle / 57.2957795));
+  motion->v_y = (v_force_pxl * cos((90 - params->v_angle) / 57.2957795));
+  motion->g = -params->gravitation/10;
+  motion->w_x = (wind_force_pxl * cos(params->wind_angle/ 57.2957795));
+  motion->w_y = (wind_force_pxl * cos((90 - params->wind_angle)/ 57.2957795));
+  return motion;
+}
+
+// Times at which start + speed * t + accel * t^2 / 2 reaches bound in
+// ascending order, returns how many there are
+int crossingTimes(double start, double speed, double accel, double bound,
+    double *times)
+{
+  double quadratic = accel / 2;
+  double constant = start - bound;
+  double discriminant = speed * speed - 4 * quadratic * constant;
+  double root = 0;
 
-  do
+  if(quadratic == 0)
   {
-    if((cur_x % 10) == 0)
+    if(speed == 0)
+      return 0;
+    times[0] = -constant / speed;
+    return 1;
+  }
+  if(discriminant < 0)
+    return 0;
+
+  // the numerically stable pair of roots
+  root = -0.5 * (speed + copysign(sqrt(discriminant), speed));
+  times[0] = root / quadratic;
+  times[1] = (root != 0) ? constant / root : times[0];
+  if(times[0] > times[1])
+  {
+    root = times[0];
+    times[0] = times[1];
+    times[1] = root;
+  }
+  return 2;
+}
+
+// Earliest time > 0 at which start + speed * t + accel * t^2 / 2 reaches
+// bound, INFINITY if it never does
+double crossingTime(double start, double speed, double accel, double bound)
+{
+  double times[2];
+  int count = crossingTimes(start, speed, accel, bound, times);
+  int cur_time = 0;
+
+  for(cur_time = 0; cur_time < count; cur_time++)
+    if(times[cur_time] > 0)
+      return times[cur_time];
+  return INFINITY;
+}
+
+// exitTime() together with the side of the bitmap the shot leaves at
+double exitBorder(Parameter *params, Motion *motion, int *side)
+{
+  double start_x = params->width / 2;
+  double start_y = params->height / 2;
+  double t_exit = INFINITY;
+  double t_bound = 0;
+
+  *side = EXIT_NONE;
+  if(start_x < 0.5 || start_x >= params->width - 0.5 ||
+      start_y < 0.5 || start_y >= params->height - 0.5)
+    return 0;
+  if((t_bound = crossingTime(start_x, motion->v_x, motion->w_x, 0.5)) < t_exit)
+  {
+    t_exit = t_bound;
+    *side = EXIT_LEFT;
+  }
+  if((t_bound = crossingTime(start_x, motion->v_x, motion->w_x,
+      params->width - 0.5)) < t_exit)
+  {
+    t_exit = t_bound;
+    *side = EXIT_RIGHT;
+  }
+  if((t_bound = crossingTime(start_y, motion->v_y, motion->g + motion->w_y,
+      0.5)) < t_exit)
+  {
+    t_exit = t_bound;
+    *side = EXIT_BOTTOM;
+  }
+  if((t_bound = crossingTime(start_y, motion->v_y, motion->g + motion->w_y,
+      params->height - 0.5)) < t_exit)
+  {
+    t_exit = t_bound;
+    *side = EXIT_TOP;
+  }
+  return t_exit;
+}
+
+// Time at which the rounded position leaves the bitmap, i.e. x < 0.5 or
+// x >= width - 0.5 and the same for y
+double exitTime(Parameter *params, Motion *motion)
+{
+  int side = 0;
+
+  return exitBorder(params, motion, &side);
+}
+
+Curve* setCurve(Parameter *params, Curve *curve)
+{
+  Motion motion;
+
+  setMotion(params, &motion);
+  curve->x = params->width / 2;
+  curve->y = params->height / 2;
+  curve->v_x = motion.v_x;
+  curve->v_y = motion.v_y;
+  curve->a_x = motion.w_x;
+  curve->a_y = motion.g + motion.w_y;
+  curve->t_exit = exitTime(params, &motion);
+  return curve;
+}
+
+// Time of the sample following the one at t when sampling adaptively, so
+// that the chord between them deviates from the parabola by at most
+// tolerance pixels. For p(t) = v t + a t^2/2 that deviation is
+// |a x v| dt^2 / (8 |v(t + dt/2)|), |a x v| being the same for all t.
+double nextSampleTime(Motion *motion, double t, double tolerance,
+    double t_exit)
+{
+  double a_x = motion->w_x;
+  double a_y = motion->g + motion->w_y;
+  double cross = fabs(a_x * motion->v_y - a_y * motion->v_x);
+  double dt = t_exit - t;
+  double v_x = 0;
+  double v_y = 0;
+  double deviation = 0;
+  int iteration = 0;
+
+  // a straight flight needs no samples in between
+  if(cross == 0)
+    return t_exit;
+  for(iteration = 0; iteration < 32; iteration++)
+  {
+    v_x = motion->v_x + a_x * (t + dt/2);
+    v_y = motion->v_y + a_y * (t + dt/2);
+    deviation = cross * dt * dt / (8 * sqrt(v_x * v_x + v_y * v_y));
+    if(deviation <= tolerance)
+      break;
+    dt *= 0.9 * sqrt(tolerance / deviation);
+  }
+  return (iteration == 0) ? t_exit : t + dt;
+}
+
+// Number of samples from the start up to and including the first one
+// outside of the bitmap, -1 if that many can't be stored
+int sampleCount(Parameter *params)
+{
+  Motion motion;
+  double t_exit = exitTime(params, setMotion(params, &motion));
+  double steps = ceil(t_exit * params->pps);
+  double t = 0;
+
+  if(params->tolerance > 0)
+  {
+    // the last sample is the one at the exit time
+    for(steps = 0; steps == 0 || t < t_exit; steps++)
+    {
+      t = nextSampleTime(&motion, t, params->tolerance, t_exit);
+      if(!(steps < INT32_MAX / sizeof(int)))
+        return -1;
+    }
+  }
+  if(steps < 1)
+    steps = 1;
+  if(!(steps < INT32_MAX / sizeof(int)))
+    return -1;
+  return (int) steps + 1;
+}
+
+Flight* startFlight(Parameter *params, int count, Flight *flight)
+{
+  setMotion(params, &flight->motion);
+  flight->x = params->width / 2;
+  flight->y = params->height / 2;
+  flight->step = 1/(float)params->pps;
+  flight->tolerance = params->tolerance;
+  flight->t_exit = (params->tolerance > 0) ?
+      exitTime(params, &flight->motion) : 0;
+  flight->t = 0;
+  flight->count = count;
+  flight->index = 0;
+  return flight;
+}
+
+// Sample cur_sample when sampling uniformly, which can be taken in any order
+void sampleAt(Flight *flight, int cur_sample, int *x, int *y)
+{
+  Motion *motion = &flight->motion;
+  float t = flight->step * cur_sample;
+
+  if(cur_sample == 0)
+  {
+    *x = flight->x;
+    *y = flight->y;
+    return;
+  }
+  *x = flight->x + motion->v_x * t + motion->w_x * t*t / 2 + 0.5;
+  *y = flight->y + motion->v_y * t + motion->g * t*t / 2 +
+      motion->w_y*t*t/ 2 + 0.5;
+}
+
+// Uniform samples first to first + count - 1 into x[] and y[], several at a
+// time where SSE2 or AVX is available. Every lane does the float arithmetic
+// of sampleAt() in the same order and adds the 0.5 in double as well, so
+// the samples are exactly the scalar ones.
+void sampleBlock(Flight *flight, int first, int count, int *x, int *y)
+{
+  int cur_sample = 0;
+#if defined(__SSE2__)
+  Motion *motion = &flight->motion;
+  __m128 step = _mm_set1_ps(flight->step);
+  __m128 start_x = _mm_set1_ps((float) flight->x);
+  __m128 start_y = _mm_set1_ps((float) flight->y);
+  __m128 v_x = _mm_set1_ps(motion->v_x);
+  __m128 v_y = _mm_set1_ps(motion->v_y);
+  __m128 w_x = _mm_set1_ps(motion->w_x);
+  __m128 w_y = _mm_set1_ps(motion->w_y);
+  __m128 g = _mm_set1_ps(motion->g);
+  __m128 half = _mm_set1_ps(0.5f);
+  __m128i index = _mm_setr_epi32(first, first + 1, first + 2, first + 3);
+  __m128 t = _mm_setzero_ps();
+  __m128 pos_x = _mm_setzero_ps();
+  __m128 pos_y = _mm_setzero_ps();
+#if defined(__AVX__)
+  __m256 step8 = _mm256_set1_ps(flight->step);
+  __m256 start_x8 = _mm256_set1_ps((float) flight->x);
+  __m256 start_y8 = _mm256_set1_ps((float) flight->y);
+  __m256 v_x8 = _mm256_set1_ps(motion->v_x);
+  __m256 v_y8 = _mm256_set1_ps(motion->v_y);
+  __m256 w_x8 = _mm256_set1_ps(motion->w_x);
+  __m256 w_y8 = _mm256_set1_ps(motion->w_y);
+  __m256 g8 = _mm256_set1_ps(motion->g);
+  __m256 half8 = _mm256_set1_ps(0.5f);
+  __m256d round4 = _mm256_set1_pd(0.5);
+  __m256 t8 = _mm256_setzero_ps();
+  __m256 pos_x8 = _mm256_setzero_ps();
+  __m256 pos_y8 = _mm256_setzero_ps();
+#endif
+  __m128d round = _mm_set1_pd(0.5);
+#endif
+
+  // the start is not evaluated but taken as it is
+  if(first == 0 && count > 0)
+  {
+    sampleAt(flight, 0, x, y);
+    cur_sample = 1;
+#if defined(__SSE2__)
+    index = _mm_add_epi32(index, _mm_set1_epi32(1));
+#endif
+  }
+#if defined(__AVX__)
+  for(; cur_sample + 8 <= count; cur_sample += 8)
+  {
+    t8 = _mm256_mul_ps(step8, _mm256_cvtepi32_ps(_mm256_insertf128_si256(
+        _mm256_castsi128_si256(index), _mm_add_epi32(index,
+        _mm_set1_epi32(4)), 1)));
+    pos_x8 = _mm256_add_ps(_mm256_add_ps(start_x8, _mm256_mul_ps(v_x8, t8)),
+        _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(w_x8, t8), t8), half8));
+    pos_y8 = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(start_y8,
+        _mm256_mul_ps(v_y8, t8)), _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(
+        g8, t8), t8), half8)), _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(w_y8,
+        t8), t8), half8));
+    _mm_storeu_si128((__m128i *) (x + cur_sample), _mm256_cvttpd_epi32(
+        _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(pos_x8)),
+        round4)));
+    _mm_storeu_si128((__m128i *) (x + cur_sample + 4), _mm256_cvttpd_epi32(
+        _mm256_add_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(pos_x8, 1)),
+        round4)));
+    _mm_storeu_si128((__m128i *) (y + cur_sample), _mm256_cvttpd_epi32(
+        _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(pos_y8)),
+        round4)));
+    _mm_storeu_si128((__m128i *) (y + cur_sample + 4), _mm256_cvttpd_epi32(
+        _mm256_add_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(pos_y8, 1)),
+        round4)));
+    index = _mm_add_epi32(index, _mm_set1_epi32(8));
+  }
+#endif
+#if defined(__SSE2__)
+  for(; cur_sample + 4 <= count; cur_sample += 4)
+  {
+    t = _mm_mul_ps(step, _mm_cvtepi32_ps(index));
+    pos_x = _mm_add_ps(_mm_add_ps(start_x, _mm_mul_ps(v_x, t)),
+        _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(w_x, t), t), half));
+    pos_y = _mm_add_ps(_mm_add_ps(_mm_add_ps(start_y, _mm_mul_ps(v_y, t)),
+        _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(g, t), t), half)),
+        _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(w_y, t), t), half));
+    _mm_storeu_si128((__m128i *) (x + cur_sample), _mm_unpacklo_epi64(
+        _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtps_pd(pos_x), round)),
+        _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtps_pd(_mm_movehl_ps(pos_x,
+        pos_x)), round))));
+    _mm_storeu_si128((__m128i *) (y + cur_sample), _mm_unpacklo_epi64(
+        _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtps_pd(pos_y), round)),
+        _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtps_pd(_mm_movehl_ps(pos_y,
+        pos_y)), round))));
+    index = _mm_add_epi32(index, _mm_set1_epi32(4));
+  }
+#endif
+  for(; cur_sample < count; cur_sample++)
+    sampleAt(flight, first + cur_sample, x + cur_sample, y + cur_sample);
+}
+
+// Time intervals of 0 to the last sample in which the flight is within the
+// rows y_from to y_to, at most three
+int flightIntervals(Flight *flight, double y_from, double y_to,
+    double *t_from, double *t_to)
+{
+  Motion *motion = &flight->motion;
+  double a_y = motion->g + motion->w_y;
+  double t_last = (double) flight->step * (flight->count - 1);
+  double times[6];
+  double t = 0;
+  double y = 0;
+  int count = 0;
+  int cur_time = 0;
+  int intervals = 0;
+
+  // the flight is inside or outside between consecutive crossings
+  times[count++] = 0;
+  count += crossingTimes(flight->y, motion->v_y, a_y, y_from, times + count);
+  count += crossingTimes(flight->y, motion->v_y, a_y, y_to, times + count);
+  times[count++] = t_last;
+  for(cur_time = 0; cur_time < count; cur_time++)
+    times[cur_time] = (times[cur_time] < 0) ? 0 :
+        (times[cur_time] > t_last) ? t_last : times[cur_time];
+  for(cur_time = 1; cur_time < count; cur_time++)
+    for(t = times[cur_time], intervals = cur_time;
+        intervals > 0 && times[intervals - 1] > t; intervals--)
+    {
+      times[intervals] = times[intervals - 1];
+      times[intervals - 1] = t;
+    }
+
+  for(intervals = 0, cur_time = 0; cur_time + 1 < count; cur_time++)
+  {
+    t = (times[cur_time] + times[cur_time + 1]) / 2;
+    y = flight->y + motion->v_y * t + a_y * t * t / 2;
+    if(y < y_from || y > y_to)
+      continue;
+    if(intervals > 0 && t_to[intervals - 1] == times[cur_time])
+      t_to[intervals - 1] = times[cur_time + 1];
+    else
+    {
+      t_from[intervals] = times[cur_time];
+      t_to[intervals++] = times[cur_time + 1];
+    }
+  }
+  return intervals;
+}
+
+// Moves the cursor to the following sample and returns it in x and y, 0
+// once all count samples are taken
+int nextSample(Flight *flight, int *x, int *y)
+{
+  Motion *motion = &flight->motion;
+  double t_adaptive = 0;
+
+  if(flight->index + 1 >= flight->count)
+    return 0;
+  flight->index++;
+  if(flight->tolerance > 0)
+  {
+    t_adaptive = flight->t = nextSampleTime(motion, flight->t,
+        flight->tolerance, flight->t_exit);
+    *x = floor(flight->x + motion->v_x * t_adaptive +
+        motion->w_x * t_adaptive * t_adaptive / 2 + 0.5);
+    *y = floor(flight->y + motion->v_y * t_adaptive +
+        (motion->g + motion->w_y) * t_adaptive * t_adaptive / 2 + 0.5);
+    return 1;
+  }
+  sampleAt(flight, flight->index, x, y);
+  return 1;
+}
+
+// Fills the *counter samples of the shot, points[0][0] and points[1][0]
+// holding the start. The caller provides arrays of that size.
+int calculation(int **points, int *counter, Parameter *params)
+{
+  Flight flight;
+  int cur_x = 1;
+
+  startFlight(params, *counter, &flight);
+  flight.x = points[0][0];
+  flight.y = points[1][0];
+  if(params->tolerance <= 0)
+  {
+    sampleBlock(&flight, 1, *counter - 1, points[0] + 1, points[1] + 1);
+    return 0;
+  }
+  for(cur_x = 1; cur_x < *counter; cur_x++)
+    nextSample(&flight, &points[0][cur_x], &points[1][cur_x]);
+  return 0;
+}
+
+double curveX(Curve *curve, double t)
+{
+  return curve->x + curve->v_x * t + curve->a_x * t * t / 2;
+}
+
+double curveY(Curve *curve, double t)
+{
+  return curve->y + curve->v_y * t + curve->a_y * t * t / 2;
+}
+
+int resizePathRows(PathRows *path, int rows)
+{
+  int *x_min = NULL;
+  int *x_max = NULL;
+
+  if(rows > path->capacity)
+  {
+    if((x_min = (int *) realloc(path->x_min, sizeof(int) * rows)) == NULL)
+      return 2;
+    path->x_min = x_min;
+    if((x_max = (int *) realloc(path->x_max, sizeof(int) * rows)) == NULL)
+      return 2;
+    path->x_max = x_max;
+    path->capacity = rows;
+  }
+  path->rows = rows;
+  return 0;
+}
+
+// Time at which the coordinate p + v t + a t^2/2 reaches edge while moving
+// in the direction step, which is unique where it is monotone, or infinite
+// when it never does. Of the two forms of the root the one without
+// cancellation is taken.
+double edgeTime(double p, double v, double a, int step, double edge)
+{
+  double d = edge - p;
+  double disc = v * v + 2 * a * d;
+
+  if(disc < 0)
+    return INFINITY;
+  if(v * step > 0)
+    return 2 * d / (v + step * sqrt(disc));
+  if(a == 0)
+    return INFINITY;
+  return (step * sqrt(disc) - v) / a;
+}
+
+// Walks the pixels of the part t_from to t_to of the curve, in which x and y
+// are monotone, and records them in path. From a pixel the curve leaves its
+// cell through the vertical or the horizontal edge ahead of it, whichever
+// it reaches first, so only the time of the next edge of the coordinate
+// that stepped is solved again. The walk follows the cells the curve passes
+// through, so it can start at any time of the part and continue as a walk
+// from its start would.
+void walkParabola(Curve *curve, double t_from, double t_to, PathRows *path)
+{
+  double t_mid = (t_from + t_to) / 2;
+  int x_step = (curve->v_x + curve->a_x * t_mid < 0) ? -1 : 1;
+  int y_step = (curve->v_y + curve->a_y * t_mid < 0) ? -1 : 1;
+  int x = floor(curveX(curve, t_from) + 0.5);
+  int y = floor(curveY(curve, t_from) + 0.5);
+  int x_end = floor(curveX(curve, t_to) + 0.5);
+  int y_end = floor(curveY(curve, t_to) + 0.5);
+  double t_x = edgeTime(curve->x, curve->v_x, curve->a_x, x_step,
+      x + x_step * 0.5);
+  double t_y = edgeTime(curve->y, curve->v_y, curve->a_y, y_step,
+      y + y_step * 0.5);
+  int step_x = 0;
+  int step_y = 0;
+
+  while(1)
+  {
+    if(y >= path->first_row && y < path->first_row + path->rows)
+    {
+      if(x < path->x_min[y - path->first_row])
+        path->x_min[y - path->first_row] = x;
+      if(x > path->x_max[y - path->first_row])
+        path->x_max[y - path->first_row] = x;
+    }
+    step_x = (x_end - x) * x_step > 0;
+    step_y = (y_end - y) * y_step > 0;
+    if(!step_x && !step_y)
+      break;
+    // through the corner the step is diagonal
+    if(step_x && step_y)
+    {
+      if(t_x < t_y)
+        step_y = 0;
+      else if(t_y < t_x)
+        step_x = 0;
+    }
+    if(step_x)
+    {
+      x += x_step;
+      t_x = edgeTime(curve->x, curve->v_x, curve->a_x, x_step,
+          x + x_step * 0.5);
+    }
+    if(step_y)
+    {
+      y += y_step;
+      t_y = edgeTime(curve->y, curve->v_y, curve->a_y, y_step,
+          y + y_step * 0.5);
+    }
+  }
+}
+
+// Time in t_from to t_to at which y, monotone there, crosses the row
+// coordinate row, or the end nearest to it
+double crossTime(Curve *curve, double t_from, double t_to, double row)
+{
+  double t_low = t_from;
+  double t_high = t_to;
+  double t = 0;
+  int rising = curveY(curve, t_to) > curveY(curve, t_from);
+  int step = 0;
+
+  if((curveY(curve, t_from) < row) != rising)
+    return t_from;
+  if((curveY(curve, t_to) < row) == rising)
+    return t_to;
+  for(step = 0; step < 64 && t_low < t_high; step++)
+  {
+    t = (t_low + t_high) / 2;
+    if((curveY(curve, t) < row) == rising)
+      t_low = t;
+    else
+      t_high = t;
+  }
+  return t_low;
+}
+
+// Adds the spans a str x str square brush covers in the rows of the frame
+// when moved along the pixels of the curve, without sampling it. Every part
+// is only walked from where it enters the path rows to where it leaves
+// them, so a band costs the pixels of the curve in it.
+int addParabolaSpans(Curve *curve, int str, FrameBuffer *frame,
+    SpanList *list, PathRows *path)
+{
+  double splits[4];
+  double t_split = 0;
+  double t_enter = 0;
+  double t_leave = 0;
+  double y_low = 0;
+  double y_high = 0;
+  double y_from = 0;
+  double y_to = 0;
+  int split_count = 1;
+  int cur_split = 0;
+  int cur_row = 0;
+  int curheight = 0;
+  int x_from = 0;
+  int x_to = 0;
+  int pixels = 0;
+  int point_x[3];
+  int point_y[3];
+  int *points[2] = {point_x, point_y};
+
+  if(curve->t_exit <= 0)
+    return 0;
+
+  // velocity parallel to acceleration: the flight is a straight line,
+  // possibly turning back once
+  if(curve->a_x * curve->v_y - curve->a_y * curve->v_x == 0)
+  {
+    point_x[0] = floor(curve->x + 0.5);
+    point_y[0] = floor(curve->y + 0.5);
+    t_split = -(curve->v_x * curve->a_x + curve->v_y * curve->a_y) /
+        (curve->a_x * curve->a_x + curve->a_y * curve->a_y);
+    if(!(t_split > 0 && t_split < curve->t_exit))
+      t_split = curve->t_exit;
+    point_x[1] = floor(curveX(curve, t_split) + 0.5);
+    point_y[1] = floor(curveY(curve, t_split) + 0.5);
+    point_x[2] = floor(curveX(curve, curve->t_exit) + 0.5);
+    point_y[2] = floor(curveY(curve, curve->t_exit) + 0.5);
+    return addLineSpans(points, 3, str, frame, list);
+  }
+
+  // split where x or y turn, so that both are monotone in every piece
+  splits[0] = 0;
+  if(curve->a_x != 0 && -curve->v_x / curve->a_x > 0 &&
+      -curve->v_x / curve->a_x < curve->t_exit)
+    splits[split_count++] = -curve->v_x / curve->a_x;
+  if(curve->a_y != 0 && -curve->v_y / curve->a_y > 0 &&
+      -curve->v_y / curve->a_y < curve->t_exit)
+    splits[split_count++] = -curve->v_y / curve->a_y;
+  if(split_count == 3 && splits[1] > splits[2])
+  {
+    t_split = splits[1];
+    splits[1] = splits[2];
+    splits[2] = t_split;
+  }
+  splits[split_count] = curve->t_exit;
+
+  // path rows whose brush reaches into the frame
+  if(resizePathRows(path, frame->rows + str - 1) != 0)
+    return 2;
+  path->first_row = frame->y_offset + str/2 - str + 1;
+  // a row to spare on both sides, so the walk starts outside the path rows
+  y_low = path->first_row - 1.5;
+  y_high = path->first_row + path->rows + 0.5;
+  for(cur_split = 0; cur_split < split_count; cur_split++)
+  {
+    y_from = curveY(curve, splits[cur_split]);
+    y_to = curveY(curve, splits[cur_split + 1]);
+    if((y_from < y_low && y_to < y_low) || (y_from > y_high && y_to > y_high))
+      continue;
+    t_enter = crossTime(curve, splits[cur_split], splits[cur_split + 1],
+        (y_from < y_to) ? y_low : y_high);
+    t_leave = crossTime(curve, splits[cur_split], splits[cur_split + 1],
+        (y_from < y_to) ? y_high : y_low);
+    for(cur_row = 0; cur_row < path->rows; cur_row++)
+    {
+      path->x_min[cur_row] = INT32_MAX;
+      path->x_max[cur_row] = INT32_MIN;
+    }
+    walkParabola(curve, t_enter, t_leave, path);
+
+    // the path is monotone, so the brushes of str rows join up to one span
+    for(curheight = 0; curheight < frame->rows; curheight++)
+    {
+      x_from = INT32_MAX;
+      x_to = INT32_MIN;
+      pixels = 0;
+      for(cur_row = curheight; cur_row < curheight + str; cur_row++)
+      {
+        if(path->x_min[cur_row] > path->x_max[cur_row])
+          continue;
+        if(path->x_min[cur_row] < x_from)
+          x_from = path->x_min[cur_row];
+        if(path->x_max[cur_row] > x_to)
+          x_to = path->x_max[cur_row];
+        pixels += path->x_max[cur_row] - path->x_min[cur_row] + 1;
+      }
+      if(!pixels)
+        continue;
+      if(addSpan(list, frame->y_offset + curheight, x_from - str/2,
+          x_to - str/2 + str - 1))
+        return 2;
+      list->stats.brush_pixels += (uint64_t) pixels * str;
+    }
+  }
+  return 0;
+}
+
+// Adds the spans of the flight block by block while its samples are
+// generated, only FLIGHT_BLOCK of them are held at a time. As all spans have
+// one color they can be filled whenever the list grows long, which keeps it
+// small. Uniform samples are only taken in the time intervals in which the
+// flight is near the rows of the frame, with a few samples to spare for the
+// float rounding of their times.
+int addFlightSpans(Flight *flight, int str, int index, FrameBuffer *frame,
+    SpanList *list)
+{
+  Flight cursor = *flight;
+  int block_x[FLIGHT_BLOCK + 1];
+  int block_y[FLIGHT_BLOCK + 1];
+  int *points[2] = {block_x, block_y};
+  double t_from[3];
+  double t_to[3];
+  double slack = 0;
+  int intervals = 1;
+  int cur_interval = 0;
+  int cur_sample = 0;
+  int cur_block = 0;
+  int count = 0;
+  int first = 0;
+  int last = flight->count - 1;
+  int drawn = 0;
+
+  block_x[0] = flight->x;
+  block_y[0] = flight->y;
+  if(flight->tolerance <= 0)
+    intervals = flightIntervals(flight, frame->y_offset - str - 2,
+        frame->y_offset + frame->rows + str + 1, t_from, t_to);
+  for(cur_interval = 0; cur_interval < intervals; cur_interval++)
+  {
+    if(flight->tolerance <= 0)
+    {
+      slack = 2 + t_to[cur_interval] / flight->step * 1e-6;
+      first = floor(t_from[cur_interval] / flight->step - slack);
+      last = ceil(t_to[cur_interval] / flight->step + slack);
+      first = (first < drawn) ? drawn : first;
+      last = (last > flight->count - 1) ? flight->count - 1 : last;
+      if(first >= last)
+        continue;
+      sampleAt(flight, first, &block_x[0], &block_y[0]);
+    }
+    // every block continues from the last sample of the one before
+    for(cur_sample = first; cur_sample < last; cur_sample += count)
+    {
+      count = (last - cur_sample < FLIGHT_BLOCK) ? last - cur_sample :
+          FLIGHT_BLOCK;
+      if(flight->tolerance <= 0)
+        sampleBlock(flight, cur_sample + 1, count, block_x + 1, block_y + 1);
+      else
+        for(cur_block = 1; cur_block <= count; cur_block++)
+          nextSample(&cursor, &block_x[cur_block], &block_y[cur_block]);
+      if(addLineSpans(points, count + 1, str, frame, list) != 0)
+        return 2;
+      if(list->count >= FLIGHT_SPANS)
+        fillSpans(list, index, frame);
+      block_x[0] = block_x[count];
+      block_y[0] = block_y[count];
+    }
+    drawn = last;
+  }
+  return 0;
+}
+
+int drawRectangle(int **points, int index, FrameBuffer *frame)
+{
+  int curheight = 0;
+  int lastheight = 0;
+
+  // the rows of the rectangle that are held by the frame
+  curheight = (points[1][0] < points[1][1]) ? points[1][0] : points[1][1];
+  lastheight = (points[1][0] < points[1][1]) ? points[1][1] : points[1][0];
+  if(curheight < frame->y_offset)
+    curheight = frame->y_offset;
+  if(lastheight >= frame->y_offset + frame->rows)
+    lastheight = frame->y_offset + frame->rows - 1;
+
+  for(; curheight <= lastheight; curheight++)
+  {
+    if(points[0][0] > points[0][1])
+      fillSpan(frame, curheight, points[0][1], points[0][0], index);
+    else
+      fillSpan(frame, curheight, points[0][0], points[0][1], index);
+  }
+  return 0;
+}
+
+// Index of color in the palette, added if it is new, -1 if the palette is
+// full
+int paletteIndex(Palette *palette, int color)
+{
+  int cur_color = 0;
+
+  for(cur_color = 0; cur_color < palette->count; cur_color++)
+    if(palette->colors[cur_color] == (uint32_t) color)
+      return cur_color;
+  if(palette->count == PALETTE_SIZE)
+    return -1;
+  palette->colors[palette->count] = color;
+  if(palette->count < 16)
+  {
+    palette->blue[palette->count] = color & 0xFF;
+    palette->green[palette->count] = (color >> 8) & 0xFF;
+    palette->red[palette->count] = (color >> 16) & 0xFF;
+  }
+  return palette->count++;
+}
+
+// Expands a row of palette indices to BGR pixels
+void expandRow(uint8_t *indices, uint8_t *pixels, int width,
+    Palette *palette)
+{
+  int curwidth = 0;
+#ifdef __SSSE3__
+  __m128i lookup_b;
+  __m128i lookup_g;
+  __m128i lookup_r;
+  __m128i index;
+  __m128i blue;
+  __m128i green;
+  __m128i red;
+
+  // 16 pixels at a time, each color channel being a 16 entry table lookup
+  // followed by interleaving the channels into 48 bytes of BGR
+  if(palette->count <= 16)
+  {
+    lookup_b = _mm_loadu_si128((__m128i *) palette->blue);
+    lookup_g = _mm_loadu_si128((__m128i *) palette->green);
+    lookup_r = _mm_loadu_si128((__m128i *) palette->red);
+    for(; curwidth + 16 <= width; curwidth += 16)
+    {
+      index = _mm_loadu_si128((__m128i *) (indices + curwidth));
+      blue = _mm_shuffle_epi8(lookup_b, index);
+      green = _mm_shuffle_epi8(lookup_g, index);
+      red = _mm_shuffle_epi8(lookup_r, index);
+      _mm_storeu_si128((__m128i *) (pixels + curwidth * 3), _mm_or_si128(
+          _mm_or_si128(_mm_shuffle_epi8(blue, _mm_setr_epi8(0, -1, -1, 1, -1,
+          -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)), _mm_shuffle_epi8(green,
+          _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1,
+          -1))), _mm_shuffle_epi8(red, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1,
+          -1, 2, -1, -1, 3, -1, -1, 4, -1))));
+      _mm_storeu_si128((__m128i *) (pixels + curwidth * 3 + 16), _mm_or_si128(
+          _mm_or_si128(_mm_shuffle_epi8(blue, _mm_setr_epi8(-1, -1, 6, -1, -1,
+          7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)), _mm_shuffle_epi8(green,
+          _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1,
+          10))), _mm_shuffle_epi8(red, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1,
+          7, -1, -1, 8, -1, -1, 9, -1, -1))));
+      _mm_storeu_si128((__m128i *) (pixels + curwidth * 3 + 32), _mm_or_si128(
+          _mm_or_si128(_mm_shuffle_epi8(blue, _mm_setr_epi8(-1, 11, -1, -1, 12,
+          -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)), _mm_shuffle_epi8(green,
+          _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1,
+          15, -1))), _mm_shuffle_epi8(red, _mm_setr_epi8(10, -1, -1, 11, -1,
+          -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15))));
+    }
+  }
+#endif
+
+  // 4 byte stores of BGR0, each overwriting the 0 of the one before
+  for(; curwidth + 1 < width; curwidth++)
+    memcpy(pixels + curwidth * 3, &palette->colors[indices[curwidth]], 4);
+  if(curwidth < width)
+    memcpy(pixels + curwidth * 3, &palette->colors[indices[curwidth]], 3);
+}
+
+int addPrimitive(Scene *scene, int type, int color, int str, int **points,
+    int point_count)
+{
+  Primitive *primitive = NULL;
+  int cur_point = 0;
+
+  if(scene->count == scene->capacity)
+  {
+    if((primitive = (Primitive *) realloc(scene->primitives,
+        sizeof(Primitive) * (scene->capacity + SCENE_CHUNK))) == NULL)
+      return 2;
+    scene->primitives = primitive;
+    scene->capacity += SCENE_CHUNK;
+  }
+  primitive = &scene->primitives[scene->count];
+  if((primitive->index = paletteIndex(&scene->palette, color)) < 0)
+    return 6;
+  scene->count++;
+  primitive->type = type;
+  primitive->color = color;
+  primitive->str = (type != PRIM_RECTANGLE && !str) ? LINE_STRENGTH : str;
+  primitive->point_count = point_count;
+  primitive->points[0] = points ? points[0] : NULL;
+  primitive->points[1] = points ? points[1] : NULL;
+  primitive->curve = NULL;
+  primitive->flight = NULL;
+  primitive->y_min = INT32_MIN;
+  primitive->y_max = INT32_MAX;
+  if(points == NULL || point_count == 0)
+    return 0;
+
+  // the cannon parts are built in a temporary array, so keep a copy
+  if(point_count == 2 && scene->shapes + 2 <= SCENE_SHAPES)
+  {
+    primitive->points[0] = &scene->shape_points[0][scene->shapes];
+    primitive->points[1] = &scene->shape_points[1][scene->shapes];
+    memcpy(primitive->points[0], points[0], sizeof(int) * 2);
+    memcpy(primitive->points[1], points[1], sizeof(int) * 2);
+    scene->shapes += 2;
+  }
+
+  primitive->y_min = primitive->y_max = primitive->points[1][0];
+  for(cur_point = 1; cur_point < point_count; cur_point++)
+  {
+    if(primitive->points[1][cur_point] < primitive->y_min)
+      primitive->y_min = primitive->points[1][cur_point];
+    if(primitive->points[1][cur_point] > primitive->y_max)
+      primitive->y_max = primitive->points[1][cur_point];
+  }
+  if(type == PRIM_LINE)
+  {
+    primitive->y_min -= primitive->str/2;
+    primitive->y_max += primitive->str - primitive->str/2 - 1;
+  }
+  return 0;
+}
+
+int drawCannon(Parameter *params, Scene *scene)
+{
+
+  int point_x[2];
+  int point_y[2];
+  int *points[2] = {point_x, point_y};
+  int status = 0;
+  points[0][0] = 0;
+  points[0][1] = params->width;
+  points[1][0] = params->width/2 - cos((90 - params->v_angle) / 57.2957795) *
+      params->width/12;
+  points[1][1] = 0;
+  status |= addPrimitive(scene, PRIM_RECTANGLE, 0x005000, 0, points, 2);
+  points[0][1] = params->width/2;
+  points[1][1] = params->height/2;
+
+  points[0][0] = points[0][1] - cos(params->v_angle / 57.2957795) *
+      params->width/8;
+  points[1][0] = points[1][1] - cos((90 - params->v_angle) / 57.2957795) *
+      params->width/8;
+  status |= addPrimitive(scene, PRIM_LINE, 0xA0A0A0, (params->width/24),
+      points, 2);
+  points[1][1] = points[1][0] - params->width/24;
+  points[0][0] = points[0][0] - params->width/32;
+  points[0][1] = points[0][1] + params->width/32;
+
+  status |= addPrimitive(scene, PRIM_RECTANGLE, 0x705000, 0, points, 2);
+  points[0][0] = params->width/2 + cos((90 - params->v_angle) / 57.2957795) *
+      params->width/38;
+  points[1][0] = params->height/2 - cos(params->v_angle / 57.2957795) *
+      params->height/64;
+  points[0][1] = params->width/2 - cos((90 - params->v_angle) / 57.2957795) *
+      params->width/48;
+  points[1][1] = params->height/2 + cos(params->v_angle / 57.2957795) *
+      params->height/24;
+  status |= addPrimitive(scene, PRIM_LINE, 0xA0A0A0, (params->width/48),
+      points, 2);
+
+
+  return status;
+}
+
+int addParabola(Scene *scene, int color, int str, Curve *curve)
+{
+  Primitive *primitive = NULL;
+  double t_top = 0;
+  double y_from = 0;
+  double y_to = 0;
+  double y_top = 0;
+  int status = 0;
+
+  if((status = addPrimitive(scene, PRIM_PARABOLA, color, str, NULL, 0)) != 0)
+    return status;
+  primitive = &scene->primitives[scene->count - 1];
+  primitive->curve = curve;
+
+  // highest and lowest point of the flight, widened by the brush
+  y_from = floor(curve->y + 0.5);
+  y_to = floor(curveY(curve, curve->t_exit) + 0.5);
+  if(y_from > y_to)
+  {
+    y_top = y_from;
+    y_from = y_to;
+    y_to = y_top;
+  }
+  if(curve->a_y != 0 && (t_top = -curve->v_y / curve->a_y) > 0 &&
+      t_top < curve->t_exit)
+  {
+    y_top = floor(curveY(curve, t_top) + 0.5);
+    if(y_top < y_from)
+      y_from = y_top;
+    if(y_top > y_to)
+      y_to = y_top;
+  }
+  if(isfinite(y_from) && isfinite(y_to) && y_from > INT32_MIN / 2 &&
+      y_to < INT32_MAX / 2)
+  {
+    primitive->y_min = y_from - primitive->str/2 - 1;
+    primitive->y_max = y_to + primitive->str - primitive->str/2;
+  }
+  return 0;
+}
+
+int addFlight(Scene *scene, int color, int str, Flight *flight)
+{
+  Primitive *primitive = NULL;
+  Motion *motion = &flight->motion;
+  double a_y = motion->g + motion->w_y;
+  double t_last = (flight->tolerance > 0) ? flight->t_exit :
+      (double) flight->step * (flight->count - 1);
+  double t_top = 0;
+  double y_from = flight->y;
+  double y_to = flight->y + motion->v_y * t_last + a_y * t_last * t_last / 2;
+  double y_top = 0;
+  int status = 0;
+
+  if((status = addPrimitive(scene, PRIM_FLIGHT, color, str, NULL, 0)) != 0)
+    return status;
+  primitive = &scene->primitives[scene->count - 1];
+  primitive->flight = flight;
+
+  // the samples lie on the parabola up to the last one, rounded to pixels
+  if(y_from > y_to)
+  {
+    y_top = y_from;
+    y_from = y_to;
+    y_to = y_top;
+  }
+  if(a_y != 0 && (t_top = -motion->v_y / a_y) > 0 && t_top < t_last)
+  {
+    y_top = flight->y + motion->v_y * t_top + a_y * t_top * t_top / 2;
+    if(y_top < y_from)
+      y_from = y_top;
+    if(y_top > y_to)
+      y_to = y_top;
+  }
+  if(isfinite(y_from) && isfinite(y_to) && y_from > INT32_MIN / 2 &&
+      y_to < INT32_MAX / 2)
+  {
+    primitive->y_min = floor(y_from) - primitive->str/2 - 1;
+    primitive->y_max = ceil(y_to) + primitive->str - primitive->str/2 + 1;
+  }
+  return 0;
+}
+
+void resetScene(Scene *scene)
+{
+  scene->count = 0;
+  scene->first = 0;
+  scene->layer_count = 0;
+  scene->layer_colors = 0;
+  scene->shapes = 0;
+  scene->palette.count = 0;
+}
+
+// Adds a flight in color, as the parabola itself when a curve is given, as
+// its sample cursor when a flight is given or as chunks of the sampled
+// polyline. Points, curve and flight are referenced, not copied.
+int addPath(int **points, int counter, Curve *curve, Flight *flight,
+    int color, Scene *scene)
+{
+  int cur_point = 0;
+  int *chunk[2];
+  int status = 0;
+
+  if(curve != NULL)
+    return addParabola(scene, color, 0, curve);
+  if(flight != NULL)
+    return addFlight(scene, color, 0, flight);
+
+  // consecutive chunks share their end point, so no segment is lost
+  for(cur_point = 0; cur_point < counter - 1; cur_point += SCENE_CHUNK)
+  {
+    chunk[0] = points[0] + cur_point;
+    chunk[1] = points[1] + cur_point;
+    status |= addPrimitive(scene, PRIM_LINE, color, 0, chunk,
+        (counter - cur_point > SCENE_CHUNK) ? SCENE_CHUNK + 1 :
+        counter - cur_point);
+  }
+  return status;
+}
+
+// Adds the red flight of a single shot, its curve or flight kept in the scene
+int addTrajectory(int **points, int *counter, Curve *curve, Flight *flight,
+    Scene *scene)
+{
+  if(curve != NULL)
+  {
+    scene->curve = *curve;
+    curve = &scene->curve;
+  }
+  if(flight != NULL)
+  {
+    scene->flight = *flight;
+    flight = &scene->flight;
+  }
+  return addPath(points, *counter, curve, flight, 0xFF0000, scene);
+}
+
+int buildScene(int **points, int *counter, Parameter *params, Curve *curve,
+    Flight *flight, Scene *scene)
+{
+  int status = 0;
+
+  resetScene(scene);
+  status |= addPrimitive(scene, PRIM_BACKGROUND, 0x60D0FF, 0, NULL, 0);
+  status |= drawCannon(params, scene);
+  scene->layer_count = scene->count;
+  scene->layer_colors = scene->palette.count;
+  status |= addTrajectory(points, counter, curve, flight, scene);
+  return status;
+}
+
+void freeScene(Scene *scene)
+{
+  free(scene->primitives);
+  scene->primitives = NULL;
+  scene->count = 0;
+  scene->capacity = 0;
+}
+
+int binScene(Scene *scene, int y_from, int y_to, int *bin)
+{
+  int cur_primitive = 0;
+  int bin_count = 0;
+
+  for(cur_primitive = scene->first; cur_primitive < scene->count;
+      cur_primitive++)
+    if(scene->primitives[cur_primitive].y_max >= y_from &&
+        scene->primitives[cur_primitive].y_min <= y_to)
+      bin[bin_count++] = cur_primitive;
+  return bin_count;
+}
+
+void *drawBand(void *arg)
+{
+  Band *band = (Band *) arg;
+  Primitive *primitive = NULL;
+  Primitive *next = NULL;
+  int cur_bin = 0;
+
+  for(cur_bin = 0; cur_bin < band->bin_count; cur_bin++)
+  {
+    primitive = &band->scene->primitives[band->bin[cur_bin]];
+    next = (cur_bin + 1 < band->bin_count) ?
+        &band->scene->primitives[band->bin[cur_bin + 1]] : NULL;
+    if(primitive->type == PRIM_BACKGROUND)
+      drawBackground(primitive->index, &band->frame);
+    else if(primitive->type == PRIM_RECTANGLE)
+      drawRectangle(primitive->points, primitive->index, &band->frame);
+    else
+    {
+      if(primitive->type == PRIM_LINE && addLineSpans(primitive->points,
+          primitive->point_count, primitive->str, &band->frame, &band->spans))
+        band->status = 2;
+      if(primitive->type == PRIM_PARABOLA && addParabolaSpans(
+          primitive->curve, primitive->str, &band->frame, &band->spans,
+          &band->path))
+        band->status = 2;
+      if(primitive->type == PRIM_FLIGHT && addFlightSpans(primitive->flight,
+          primitive->str, primitive->index, &band->frame, &band->spans))
+        band->status = 2;
+      // consecutive lines of one color, like the trajectory chunks, are
+      // merged before filling so that their joins are filled only once
+      if(next == NULL || next->type < PRIM_LINE ||
+          next->color != primitive->color)
+        fillSpans(&band->spans, primitive->index, &band->frame);
+    }
+  }
+  return NULL;
+}
+
+int drawScene(Scene *scene, int threads, FrameBuffer *frame,
+    LineStats *stats)
+{
+  Band *bands = NULL;
+  pthread_t *thread_ids = NULL;
+  int *started = NULL;
+  int *bins = NULL;
+  int rows = 0;
+  int cur_thread = 0;
+  int status = 0;
+
+  // the thread count comes from the command line, so nothing is on the stack
+  if(threads > frame->rows)
+    threads = frame->rows;
+  bins = (int *) malloc(sizeof(int) * scene->count * threads);
+  bands = (Band *) malloc(sizeof(Band) * threads);
+  thread_ids = (pthread_t *) malloc(sizeof(pthread_t) * threads);
+  started = (int *) malloc(sizeof(int) * threads);
+  if(bins == NULL || bands == NULL || thread_ids == NULL || started == NULL)
+  {
+    free(bins);
+    free(bands);
+    free(thread_ids);
+    free(started);
+    return 2;
+  }
+
+  // every thread owns a strip of rows, so no pixel is written by two threads
+  for(cur_thread = 0; cur_thread < threads; cur_thread++)
+  {
+    memset(&bands[cur_thread], 0, sizeof(Band));
+    bands[cur_thread].scene = scene;
+    bands[cur_thread].frame = *frame;
+    bands[cur_thread].frame.y_offset = frame->y_offset +
+        rows;
+    bands[cur_thread].frame.rows = (frame->rows - rows) /
+        (threads - cur_thread);
+    bands[cur_thread].frame.pixels = frame->pixels +
+        (size_t) rows * frame->stride;
+    rows += bands[cur_thread].frame.rows;
+    bands[cur_thread].bin = bins + scene->count * cur_thread;
+    bands[cur_thread].bin_count = binScene(scene,
+        bands[cur_thread].frame.y_offset, bands[cur_thread].frame.y_offset +
+        bands[cur_thread].frame.rows - 1, bands[cur_thread].bin);
+  }
+  for(cur_thread = 1; cur_thread < threads; cur_thread++)
+    started[cur_thread] = pthread_create(&thread_ids[cur_thread], NULL,
+        drawBand, &bands[cur_thread]) == 0;
+  drawBand(&bands[0]);
+  for(cur_thread = 1; cur_thread < threads; cur_thread++)
+  {
+    if(started[cur_thread])
+      pthread_join(thread_ids[cur_thread], NULL);
+    else
+      drawBand(&bands[cur_thread]);
+  }
+  for(cur_thread = 0; cur_thread < threads; cur_thread++)
+  {
+    status |= bands[cur_thread].status;
+    stats->filled_pixels += bands[cur_thread].spans.stats.filled_pixels;
+    stats->brush_pixels += bands[cur_thread].spans.stats.brush_pixels;
+    free(bands[cur_thread].spans.spans);
+    free(bands[cur_thread].path.x_min);
+    free(bands[cur_thread].path.x_max);
+  }
+  free(bins);
+  free(bands);
+  free(thread_ids);
+  free(started);
+  return status;
+}
+
+int copyFile(int from_fd, int to_fd)
+{
+  char buffer[65536];
+  ssize_t length = 0;
+  ssize_t written = 0;
+  ssize_t offset = 0;
+
+  while((length = read(from_fd, buffer, sizeof(buffer))) > 0)
+    for(offset = 0; offset < length; offset += written)
+      if((written = write(to_fd, buffer + offset, length - offset)) <= 0)
+        return 3;
+  return (length < 0) ? 3 : 0;
+}
+
+// Copies the file into the stream and closes it
+int copyStream(int from_fd, FILE *fp)
+{
+  char buffer[65536];
+  ssize_t length = 0;
+
+  if(fp == NULL)
+    return 3;
+  while((length = read(from_fd, buffer, sizeof(buffer))) > 0)
+    fwrite(buffer, 1, length, fp);
+  if((length < 0) | ferror(fp) | (fclose(fp) != 0))
+    return 3;
+  return 0;
+}
+
+// Gives a file that shares its inode with other names, like an entry of
+// the cache linked by hand, an inode of its own before it is written, so the
+// other names keep their content. keep copies the content over for files
+// that are drawn into, others are just unlinked.
+int unshareFile(char *file_name, int keep)
+{
+  char *temp_path = NULL;
+  int from_fd = 0;
+  int to_fd = 0;
+  int status = 0;
+  struct stat file_stat;
+
+  if(stat(file_name, &file_stat) != 0 || file_stat.st_nlink < 2)
+    return 0;
+  if(!keep)
+    return (unlink(file_name) != 0) ? 3 : 0;
+  if(asprintf(&temp_path, "%s.XXXXXX", file_name) < 0)
+    return 2;
+  if((from_fd = open(file_name, O_RDONLY)) < 0 ||
+      (to_fd = mkstemp(temp_path)) < 0)
+  {
+    if(from_fd >= 0)
+      close(from_fd);
+    free(temp_path);
+    return 3;
+  }
+  if((copyFile(from_fd, to_fd) != 0) | (fchmod(to_fd, 0644) != 0) |
+      (close(to_fd) != 0) || rename(temp_path, file_name) != 0)
+  {
+    unlink(temp_path);
+    status = 3;
+  }
+  close(from_fd);
+  free(temp_path);
+  return status;
+}
+
+FILE *openOutput(char *file_name, Options *options)
+{
+  int fd = 0;
+  FILE *fp = NULL;
+
+  if(strcmp(file_name, "-") != 0)
+    return (unshareFile(file_name, 0) == 0) ? fopen(file_name, "wb") : NULL;
+  if(options->memory != NULL)
+    return open_memstream(&options->memory->data, &options->memory->size);
+  if((fd = dup(options->output_fd)) < 0)
+    return NULL;
+  if((fp = fdopen(fd, "wb")) == NULL)
+    close(fd);
+  return fp;
+}
+
+uint8_t *reserveBytes(ByteBuffer *buffer, size_t size)
+{
+  uint8_t *data = NULL;
+  size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+
+  while(capacity - buffer->size < size)
+    capacity *= 2;
+  if(capacity != buffer->capacity)
+  {
+    if((data = (uint8_t *) realloc(buffer->data, capacity)) == NULL)
+      return NULL;
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+  return buffer->data + buffer->size;
+}
+
+int runLength(uint8_t *indices, int width, int curwidth)
+{
+  int length = 1;
+
+  while(curwidth + length < width && length < 255 &&
+      indices[curwidth + length] == indices[curwidth])
+    length++;
+  return length;
+}
+
+// Encodes a row of palette indices as BI_RLE8 or BI_RLE4: runs of one index
+// as (count, index), stretches without runs of 3 in absolute mode as
+// (0, count, indices) padded to 16 bit, and the row closed with (0, 0)
+int encodeRleRow(uint8_t *indices, int width, int bits, ByteBuffer *buffer)
+{
+  uint8_t *out = NULL;
+  int curwidth = 0;
+  int length = 0;
+  int literal = 0;
+  int cur_literal = 0;
+  int bytes = 0;
+
+  // worst case is absolute mode all along
+  if((out = reserveBytes(buffer, width + width / 255 * 2 + 8)) == NULL)
+    return 2;
+  while(curwidth < width)
+  {
+    length = runLength(indices, width, curwidth);
+    if(length < 3)
+    {
+      // collect the stretch up to the next run worth encoding
+      for(literal = 0; curwidth + literal < width && literal < 255;
+          literal += length)
+      {
+        length = runLength(indices, width, curwidth + literal);
+        if(length >= 3)
+          break;
+        if(literal + length > 255)
+          length = 255 - literal;
+      }
+      if(literal >= 3)
+      {
+        *out++ = 0;
+        *out++ = literal;
+        if(bits == 8)
+        {
+          memcpy(out, indices + curwidth, literal);
+          bytes = literal;
+        }
+        else
+        {
+          bytes = (literal + 1) / 2;
+          for(cur_literal = 0; cur_literal < literal; cur_literal += 2)
+            out[cur_literal / 2] = (indices[curwidth + cur_literal] << 4) |
+                ((cur_literal + 1 < literal) ?
+                indices[curwidth + cur_literal + 1] : 0);
+        }
+        out += bytes;
+        if(bytes & 1)
+          *out++ = 0;
+        curwidth += literal;
+        continue;
+      }
+      length = runLength(indices, width, curwidth);
+    }
+    *out++ = length;
+    *out++ = (bits == 8) ? indices[curwidth] :
+        (indices[curwidth] << 4) | indices[curwidth];
+    curwidth += length;
+  }
+  *out++ = 0;
+  *out++ = 0;
+  buffer->size = out - buffer->data;
+  return 0;
+}
+
+// Deflate length and distance codes 257.. and 0.. start at these values,
+// followed by the given number of extra bits
+static const uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15,
+    17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227,
+    258};
+static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1,
+    2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25,
+    33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+    4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4,
+    5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+uint32_t pngCrc(PngStream *png, uint32_t crc, const uint8_t *data,
+    size_t size)
+{
+  size_t curbyte = 0;
+
+  for(curbyte = 0; curbyte < size; curbyte++)
+    crc = png->crc_table[(crc ^ data[curbyte]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+void putBigEndian(uint8_t *out, uint32_t value)
+{
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+void writePngChunk(PngStream *png, const char *type, const uint8_t *data,
+    uint32_t size)
+{
+  uint8_t field[4];
+  uint32_t crc = pngCrc(png, 0xffffffff, (const uint8_t *) type, 4);
+
+  crc = pngCrc(png, crc, data, size) ^ 0xffffffff;
+  putBigEndian(field, size);
+  fwrite(field, 1, 4, png->fp);
+  fwrite(type, 1, 4, png->fp);
+  if(size)
+    fwrite(data, 1, size, png->fp);
+  putBigEndian(field, crc);
+  fwrite(field, 1, 4, png->fp);
+}
+
+void putByte(PngStream *png, uint8_t value)
+{
+  png->chunk.data[png->chunk.size++] = value;
+  if(png->chunk.size == PNG_CHUNK)
+  {
+    writePngChunk(png, "IDAT", png->chunk.data, png->chunk.size);
+    png->chunk.size = 0;
+  }
+}
+
+// Byte aligned data of a stored block
+void putBytes(PngStream *png, const uint8_t *data, size_t size)
+{
+  size_t length = 0;
+
+  while(size > 0)
+  {
+    length = PNG_CHUNK - png->chunk.size;
+    if(length > size)
+      length = size;
+    memcpy(png->chunk.data + png->chunk.size, data, length);
+    png->chunk.size += length - 1;
+    putByte(png, data[length - 1]);
+    data += length;
+    size -= length;
+  }
+}
+
+// Deflate packs bits starting at the least significant one
+void putBits(PngStream *png, uint32_t value, int count)
+{
+  png->bits |= (uint64_t) value << png->bit_count;
+  png->bit_count += count;
+  while(png->bit_count >= 8)
+  {
+    putByte(png, png->bits & 0xff);
+    png->bits >>= 8;
+    png->bit_count -= 8;
+  }
+}
+
+void alignBits(PngStream *png)
+{
+  if(png->bit_count > 0)
+    putBits(png, 0, 8 - png->bit_count);
+}
+
+// Huffman codes are packed starting at the most significant bit
+void putCode(PngStream *png, uint32_t code, int count)
+{
+  uint32_t reversed = 0;
+  int curbit = 0;
+
+  for(curbit = 0; curbit < count; curbit++)
+    reversed |= ((code >> curbit) & 1) << (count - 1 - curbit);
+  putBits(png, reversed, count);
+}
+
+// Symbol of the fixed Huffman literal/length alphabet
+void putSymbol(PngStream *png, int symbol)
+{
+  if(symbol < 144)
+    putCode(png, 0x30 + symbol, 8);
+  else if(symbol < 256)
+    putCode(png, 0x190 + symbol - 144, 9);
+  else if(symbol < 280)
+    putCode(png, symbol - 256, 7);
+  else
+    putCode(png, 0xc0 + symbol - 280, 8);
+}
+
+void putMatch(PngStream *png, int length, int distance)
+{
+  int code = 28;
+
+  while(length_base[code] > length)
+    code--;
+  putSymbol(png, 257 + code);
+  putBits(png, length - length_base[code], length_extra[code]);
+  code = 29;
+  while(distance_base[code] > distance)
+    code--;
+  putCode(png, code, 5);
+  putBits(png, distance - distance_base[code], distance_extra[code]);
+}
+
+uint8_t *windowAt(PngStream *png, size_t pos)
+{
+  return png->window + (pos - png->window_pos);
+}
+
+void insertHash(PngStream *png, size_t pos)
+{
+  uint8_t *at = windowAt(png, pos);
+  int hash = ((at[0] << 10) ^ (at[1] << 5) ^ at[2]) &
+      ((1 << PNG_HASH_BITS) - 1);
+
+  png->prev[pos & (PNG_WINDOW - 1)] = png->head[hash];
+  png->head[hash] = pos;
+}
+
+int matchLength(PngStream *png, size_t distance, int max_length)
+{
+  uint8_t *at = windowAt(png, png->pos);
+  int length = 0;
+
+  if(distance == 0 || distance > png->pos - png->window_pos ||
+      distance > PNG_WINDOW)
+    return 0;
+  while(length < max_length && at[length] == at[length - (int) distance])
+    length++;
+  return length;
+}
+
+// Longest match at pos. Flat scenes repeat mostly the pixel before and the
+// pixel one row up, so level 1 only checks those two distances. Higher
+// levels also follow the hash chain, from 16 earlier matches at level 2 to
+// 2048 at level 9; shorter chains mostly find far matches that cost more
+// than they save.
+int findMatch(PngStream *png, int max_length, int *distance)
+{
+  uint8_t *at = windowAt(png, png->pos);
+  int hash = 0;
+  int length = 0;
+  int best = 0;
+  int chain = 0;
+  int64_t candidate = 0;
+
+  if((best = matchLength(png, 1, max_length)) > 0)
+    *distance = 1;
+  if((length = matchLength(png, png->row_bytes, max_length)) > best)
+  {
+    best = length;
+    *distance = png->row_bytes;
+  }
+  if(png->level < 2 || best == max_length || max_length < 3)
+    return best;
+  hash = ((at[0] << 10) ^ (at[1] << 5) ^ at[2]) & ((1 << PNG_HASH_BITS) - 1);
+  chain = 1 << (png->level + 2);
+  for(candidate = png->head[hash]; candidate >= 0 && chain-- > 0;
+      candidate = png->prev[candidate & (PNG_WINDOW - 1)])
+  {
+    if((length = matchLength(png, png->pos - candidate, max_length)) > best)
+    {
+      best = length;
+      *distance = png->pos - candidate;
+      if(best == max_length)
+        break;
+    }
+    if(png->prev[candidate & (PNG_WINDOW - 1)] >= candidate)
+      break;
+  }
+  return best;
+}
+
+// Compresses the window up to the lookahead a match needs, or everything
+// when flushing. Level 0 writes stored blocks. From level 2 on a match is
+// put off for a literal when the match at the next byte is longer, as a
+// short far match would otherwise cut into the run that follows it.
+void deflateWindow(PngStream *png, int flush)
+{
+  size_t length = 0;
+  size_t curbyte = 0;
+  size_t next = 0;
+  int distance = 0;
+  int next_distance = 0;
+
+  if(png->level == 0)
+  {
+    while(png->end - png->pos >= PNG_WINDOW || (flush && png->pos < png->end))
+    {
+      length = (png->end - png->pos < PNG_WINDOW) ? png->end - png->pos :
+          PNG_WINDOW;
+      putBits(png, 0, 3);
+      alignBits(png);
+      putBits(png, length, 16);
+      putBits(png, ~length & 0xffff, 16);
+      putBytes(png, windowAt(png, png->pos), length);
+      png->pos += length;
+    }
+    return;
+  }
+  while(png->end - png->pos >= PNG_LOOKAHEAD || (flush && png->pos < png->end))
+  {
+    length = (png->end - png->pos < 258) ? png->end - png->pos : 258;
+    if((length = findMatch(png, length, &distance)) >= 3 &&
+        png->level >= 2 && png->pos + 1 < png->end)
+    {
+      png->pos++;
+      next = (png->end - png->pos < 258) ? png->end - png->pos : 258;
+      if(findMatch(png, next, &next_distance) > (int) length)
+        length = 0;
+      png->pos--;
+    }
+    if(length >= 3)
+      putMatch(png, length, distance);
+    else
+    {
+      putSymbol(png, *windowAt(png, png->pos));
+      length = 1;
+    }
+    if(png->level >= 2)
+      for(curbyte = 0; curbyte < length; curbyte++)
+        if(png->pos + curbyte + 3 <= png->end)
+          insertHash(png, png->pos + curbyte);
+    png->pos += length;
+  }
+}
+
+void writePngData(PngStream *png, const uint8_t *data, size_t size)
+{
+  size_t length = 0;
+  size_t curbyte = 0;
+
+  while(size > 0)
+  {
+    // the encoder is always more than a window behind when sliding
+    if(png->end - png->window_pos == 2 * PNG_WINDOW)
+    {
+      memmove(png->window, png->window + PNG_WINDOW, PNG_WINDOW);
+      png->window_pos += PNG_WINDOW;
+    }
+    length = 2 * PNG_WINDOW - (png->end - png->window_pos);
+    if(length > size)
+      length = size;
+    memcpy(windowAt(png, png->end), data, length);
+    // the sums stay below 2^32 for 5552 bytes between the modulos
+    for(curbyte = 0; curbyte < length; curbyte++)
+    {
+      png->adler_a += data[curbyte];
+      png->adler_b += png->adler_a;
+      if(curbyte % 5552 == 5551)
+      {
+        png->adler_a %= 65521;
+        png->adler_b %= 65521;
+      }
+    }
+    png->adler_a %= 65521;
+    png->adler_b %= 65521;
+    png->end += length;
+    data += length;
+    size -= length;
+    deflateWindow(png, 0);
+  }
+}
+
+// Palette indices go out unfiltered as the PNG spec recommends for palette
+// images, the rows above are found by the matches anyway
+void writePngRow(PngStream *png, const uint8_t *indices, int width)
+{
+  uint8_t filter = 0;
+
+  writePngData(png, &filter, 1);
+  writePngData(png, indices, width);
+}
+
+void freePng(PngStream *png)
+{
+  free(png->window);
+  free(png->head);
+  free(png->prev);
+  free(png->chunk.data);
+}
+
+// Writes signature, header and palette and starts the zlib stream
+int initPng(PngStream *png, Parameter *params, Palette *palette, int level,
+    FILE *fp)
+{
+  uint8_t header[13];
+  uint8_t colors[3 * PALETTE_SIZE];
+  uint32_t crc = 0;
+  int curcolor = 0;
+  int curbit = 0;
+
+  memset(png, 0, sizeof(PngStream));
+  png->fp = fp;
+  png->level = level;
+  png->row_bytes = params->width + 1;
+  png->adler_a = 1;
+  png->window = (uint8_t *) malloc(2 * PNG_WINDOW);
+  png->chunk.data = (uint8_t *) malloc(PNG_CHUNK);
+  png->chunk.capacity = PNG_CHUNK;
+  if(level >= 2)
+  {
+    png->head = (int64_t *) malloc(sizeof(int64_t) << PNG_HASH_BITS);
+    png->prev = (int64_t *) malloc(sizeof(int64_t) * PNG_WINDOW);
+  }
+  if(png->window == NULL || png->chunk.data == NULL || (level >= 2 &&
+      (png->head == NULL || png->prev == NULL)))
+  {
+    freePng(png);
+    return 2;
+  }
+  if(level >= 2)
+    memset(png->head, 0xff, sizeof(int64_t) << PNG_HASH_BITS);
+  for(curcolor = 0; curcolor < 256; curcolor++)
+  {
+    for(crc = curcolor, curbit = 0; curbit < 8; curbit++)
+      crc = (crc & 1) ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+    png->crc_table[curcolor] = crc;
+  }
+
+  fwrite("\211PNG\r\n\032\n", 1, 8, fp);
+  putBigEndian(header, params->width);
+  putBigEndian(header + 4, params->height);
+  header[8] = 8;
+  header[9] = 3;
+  header[10] = header[11] = header[12] = 0;
+  writePngChunk(png, "IHDR", header, 13);
+  for(curcolor = 0; curcolor < palette->count; curcolor++)
+  {
+    colors[3 * curcolor] = palette->colors[curcolor] >> 16;
+    colors[3 * curcolor + 1] = palette->colors[curcolor] >> 8;
+    colors[3 * curcolor + 2] = palette->colors[curcolor];
+  }
+  writePngChunk(png, "PLTE", colors, 3 * palette->count);
+
+  // zlib header, then a single final block with the fixed codes
+  putByte(png, 0x78);
+  putByte(png, 0x01);
+  if(level > 0)
+    putBits(png, 3, 3);
+  return 0;
+}
+
+void finishPng(PngStream *png)
+{
+  uint8_t adler[4];
+
+  deflateWindow(png, 1);
+  if(png->level > 0)
+    putSymbol(png, 256);
+  else
+  {
+    putBits(png, 1, 3);
+    alignBits(png);
+    putBits(png, 0xffff0000, 32);
+  }
+  alignBits(png);
+  putBigEndian(adler, (png->adler_b << 16) | png->adler_a);
+  putByte(png, adler[0]);
+  putByte(png, adler[1]);
+  putByte(png, adler[2]);
+  putByte(png, adler[3]);
+  if(png->chunk.size > 0)
+    writePngChunk(png, "IDAT", png->chunk.data, png->chunk.size);
+  writePngChunk(png, "IEND", NULL, 0);
+}
+
+// Writes the rows held by the frame in the output format, compressed rows
+// are collected in rle. With patch set they go out per band.
+int writeRows(FrameBuffer *frame, Palette *palette, Output *output)
+{
+  int currow = 0;
+  int curwidth = 0;
+  int row_size = rowStride(frame->width, formatBits(output->format));
+  uint8_t *indices = NULL;
+  uint8_t *row = output->row;
+
+  // the frame already holds the rows of an 8 bit bitmap, mapped ones are
+  // even rendered in place
+  if(output->format == FORMAT_BMP8)
+  {
+    if(output->map == NULL)
+      fwrite(frame->pixels, frame->stride, frame->rows, output->fp);
+    return 0;
+  }
+  // PNG rows run top-down
+  if(output->format == FORMAT_PNG)
+  {
+    for(currow = frame->rows - 1; currow >= 0; currow--)
+      writePngRow(&output->png, frame->pixels + (size_t) currow *
+          frame->stride, frame->width);
+    return 0;
+  }
+  for(currow = 0; currow < frame->rows; currow++)
+  {
+    indices = frame->pixels + (size_t) currow * frame->stride;
+    if(output->map != NULL)
+      row = output->pixels + (size_t) (frame->y_offset + currow) * row_size;
+    if(output->format == FORMAT_BMP24)
+      expandRow(indices, row, frame->width, palette);
+    else if(output->format == FORMAT_BMP4)
+    {
+      for(curwidth = 0; curwidth + 1 < frame->width; curwidth += 2)
+        row[curwidth / 2] = (indices[curwidth] << 4) | indices[curwidth + 1];
+      if(curwidth < frame->width)
+        row[curwidth / 2] = indices[curwidth] << 4;
+    }
+    else
+    {
+      if(encodeRleRow(indices, frame->width, formatBits(output->format),
+          &output->rle) != 0)
+        return 2;
+      continue;
+    }
+    if(output->map == NULL)
+      fwrite(row, row_size, 1, output->fp);
+  }
+  // all but the end of the last line, which becomes the end of the bitmap
+  if(output->patch && output->rle.size > 2)
+  {
+    fwrite(output->rle.data, 1, output->rle.size - 2, output->fp);
+    output->encoded += output->rle.size - 2;
+    memmove(output->rle.data, output->rle.data + output->rle.size - 2, 2);
+    output->rle.size = 2;
+  }
+  return 0;
+}
+
+// Sizes the output file for the uncompressed bitmap and maps it, header
+// and palette are written in place. The blocks are allocated up front, a
+// full disk would otherwise only show as SIGBUS while rendering.
+int mapOutput(char *file_name, Parameter *params, BitMap *bmap,
+    Palette *palette, Output *output)
+{
+  int fd = 0;
+  uint8_t *map = NULL;
+  size_t offset = bmap->file_header.fileoffset_to_pixelarray;
+  size_t size = offset + (size_t) params->height *
+      rowStride(params->width, formatBits(output->format));
+
+  if(unshareFile(file_name, 0) != 0 ||
+      (fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    return 3;
+  if(ftruncate(fd, size) != 0 || posix_fallocate(fd, 0, size) != 0 ||
+      (map = (uint8_t *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+      fd, 0)) == MAP_FAILED)
+  {
+    close(fd);
+    return 3;
+  }
+  close(fd);
+  memcpy(map, bmap, sizeof(BitMap));
+  memcpy(map + sizeof(BitMap), palette->colors, offset - sizeof(BitMap));
+  output->map = map;
+  output->map_size = size;
+  output->pixels = map + offset;
+  return 0;
+}
+
+// The futex words live in the shared segment, so no private futexes
+void waitWord(uint32_t *word, uint32_t value)
+{
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+#else
+  struct timespec pause = {0, 1000000};
+
+  if(__atomic_load_n(word, __ATOMIC_ACQUIRE) == value)
+    nanosleep(&pause, NULL);
+#endif
+}
+
+void wakeWord(uint32_t *word)
+{
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#else
+  (void) word;
+#endif
+}
+
+// Creates the segment, 1 if one of that name exists already: it may be the
+// ring of another producer or another program's segment, so it is left
+// alone. A slot takes any uncompressed bitmap of the configured size unless
+// --shm-slot gives its size.
+int openRing(Options *options, Parameter *params, ShmRing *ring)
+{
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t slot_size = options->shm_slot_size;
+  uint64_t indexed = 0;
+  int fd = 0;
+
+  memset(ring, 0, sizeof(ShmRing));
+  if(slot_size == 0)
+  {
+    slot_size = sizeof(BitMap) + (uint64_t) params->height *
+        rowStride(params->width, BITS_PER_PIXEL);
+    indexed = sizeof(BitMap) + 4 * 256 + (uint64_t) params->height *
+        rowStride(params->width, 8);
+    if(indexed > slot_size)
+      slot_size = indexed;
+  }
+  slot_size = (slot_size + SHM_BITMAP_OFFSET + page - 1) / page * page;
+  ring->size = page + slot_size * options->shm_slots;
+  if((fd = shm_open(options->shm_name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+    return (errno == EEXIST) ? 1 : 3;
+  if(ftruncate(fd, ring->size) != 0 ||
+      posix_fallocate(fd, 0, ring->size) != 0 ||
+      (ring->header = (ShmHeader *) mmap(NULL, ring->size, PROT_READ |
+      PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+  {
+    close(fd);
+    shm_unlink(options->shm_name);
+    return 3;
+  }
+  close(fd);
+  ring->header->slot_count = options->shm_slots;
+  ring->header->slot_size = slot_size;
+  ring->header->data_offset = page;
+  pthread_mutex_init(&ring->lock, NULL);
+  // the magic goes in last, a consumer checks it before using the header
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(ring->header->magic, SHM_MAGIC, 8);
+  options->ring = ring;
+  return 0;
+}
+
+// Takes the next job number and waits until its slot is free again
+ShmSlot *acquireSlot(ShmRing *ring, Parameter *params, int job,
+    uint32_t *sequence)
+{
+  ShmHeader *header = ring->header;
+  ShmSlot *slot = NULL;
+  uint32_t consumed = 0;
+
+  pthread_mutex_lock(&ring->lock);
+  *sequence = ring->next++;
+  pthread_mutex_unlock(&ring->lock);
+  while((uint32_t) (*sequence - (consumed = __atomic_load_n(&header->consumed,
+      __ATOMIC_ACQUIRE))) >= header->slot_count)
+    waitWord(&header->consumed, consumed);
+  slot = (ShmSlot *) ((uint8_t *) header + header->data_offset +
+      (*sequence % header->slot_count) * header->slot_size);
+  slot->v_angle = params->v_angle;
+  slot->v_speed = params->v_speed;
+  slot->job = job;
+  slot->size = 0;
+  return slot;
+}
+
+void publishSlot(ShmSlot *slot, uint32_t sequence, uint64_t size, int status)
+{
+  slot->size = size;
+  slot->status = status;
+  __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELEASE);
+  wakeWord(&slot->sequence);
+}
+
+// Ends the stream and unmaps the segment, which stays for the consumer to
+// read and unlink
+void closeRing(ShmRing *ring, Parameter *params)
+{
+  uint32_t sequence = 0;
+  ShmSlot *slot = acquireSlot(ring, params, 0, &sequence);
+
+  publishSlot(slot, sequence, 0, 0);
+  pthread_mutex_destroy(&ring->lock);
+  munmap(ring->header, ring->size);
+}
+
+// A job writing to "-" takes its slot before anything can fail, so that
+// the consumer sees every job, and gives it back with its status once done
+void takeSlot(Options *options, Parameter *params, char *bmp_name, int job)
+{
+  if(options->ring != NULL && !options->composite &&
+      strcmp(bmp_name, "-") == 0)
+    options->slot = acquireSlot(options->ring, params, job,
+        &options->sequence);
+}
+
+void giveSlot(Options *options, int status)
+{
+  if(options->slot == NULL)
+    return;
+  publishSlot(options->slot, options->sequence, status ? 0 :
+      options->slot->size, status);
+  options->slot = NULL;
+}
+
+// The bitmap is rendered in place into the slot, like into a mapped file
+int mapSlot(ShmRing *ring, ShmSlot *slot, Parameter *params, BitMap *bmap,
+    Palette *palette, Output *output)
+{
+  uint8_t *map = NULL;
+  size_t offset = bmap->file_header.fileoffset_to_pixelarray;
+  size_t size = offset + (size_t) params->height *
+      rowStride(params->width, formatBits(output->format));
+
+  if(size > ring->header->slot_size - SHM_BITMAP_OFFSET)
+    return 8;
+  map = (uint8_t *) slot + SHM_BITMAP_OFFSET;
+  memcpy(map, bmap, sizeof(BitMap));
+  memcpy(map + sizeof(BitMap), palette->colors, offset - sizeof(BitMap));
+  output->map = map;
+  output->map_size = size;
+  output->pixels = map + offset;
+  return 0;
+}
+
+// SVG y runs down, a pixel row y of the frame covers height - y - 1 to
+// height - y. The square brush of lines is centered half a pixel off for
+// odd strengths, as it covers x - str/2 to x - str/2 + str - 1.
+double svgX(double x, int str)
+{
+  return x + (str % 2) * 0.5;
+}
+
+double svgY(Parameter *params, double y, int str)
+{
+  return params->height - y - (str % 2) * 0.5;
+}
+
+// Writes the primitives of the scene as SVG shapes instead of pixels, the
+// trajectory chunks are joined into one polyline again
+void startSvgPolyline(Primitive *primitive, FILE *fp)
+{
+  fprintf(fp, "<polyline fill=\"none\" stroke=\"#%06x\" stroke-width=\"%d\" "
+      "stroke-linecap=\"square\" stroke-linejoin=\"round\" points=\"",
+      primitive->color, primitive->str);
+}
+
+int writeSvg(Parameter *params, Scene *scene, FILE *fp)
+{
+  Primitive *primitive = NULL;
+  Curve *curve = NULL;
+  Flight cursor;
+  int cur_primitive = 0;
+  int cur_point = 0;
+  int x_from = 0;
+  int x_to = 0;
+  int y_from = 0;
+  int y_to = 0;
+  int x = 0;
+  int y = 0;
+
+  fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" "
+      "viewBox=\"0 0 %d %d\" shape-rendering=\"crispEdges\">\n",
+      params->width, params->height, params->width, params->height);
+  for(cur_primitive = 0; cur_primitive < scene->count; cur_primitive++)
+  {
+    primitive = &scene->primitives[cur_primitive];
+    switch(primitive->type)
+    {
+      case PRIM_BACKGROUND:
+        fprintf(fp, "<rect width=\"%d\" height=\"%d\" fill=\"#%06x\"/>\n",
+            params->width, params->height, primitive->color);
+        break;
+      case PRIM_RECTANGLE:
+        x_from = (primitive->points[0][0] < primitive->points[0][1]) ?
+            primitive->points[0][0] : primitive->points[0][1];
+        x_to = primitive->points[0][0] + primitive->points[0][1] - x_from;
+        y_from = (primitive->points[1][0] < primitive->points[1][1]) ?
+            primitive->points[1][0] : primitive->points[1][1];
+        y_to = primitive->points[1][0] + primitive->points[1][1] - y_from;
+        fprintf(fp, "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" "
+            "fill=\"#%06x\"/>\n", x_from, params->height - y_to - 1,
+            x_to - x_from + 1, y_to - y_from + 1, primitive->color);
+        break;
+      case PRIM_LINE:
+        startSvgPolyline(primitive, fp);
+        for(cur_point = 0; cur_point < primitive->point_count; cur_point++)
+          fprintf(fp, "%s%.7g,%.7g", cur_point ? " " : "",
+              svgX(primitive->points[0][cur_point], primitive->str),
+              svgY(params, primitive->points[1][cur_point], primitive->str));
+        // following chunks start at the last point of this one
+        while(cur_primitive + 1 < scene->count &&
+            primitive[1].type == PRIM_LINE &&
+            primitive[1].color == primitive->color &&
+            primitive[1].str == primitive->str)
+        {
+          primitive++;
+          cur_primitive++;
+          for(cur_point = 1; cur_point < primitive->point_count; cur_point++)
+            fprintf(fp, " %.7g,%.7g",
+                svgX(primitive->points[0][cur_point], primitive->str),
+                svgY(params, primitive->points[1][cur_point], primitive->str));
+        }
+        fprintf(fp, "\"/>\n");
+        break;
+      case PRIM_PARABOLA:
+        // the flight is a quadratic Bezier curve with the control point
+        // where the tangents at start and exit meet
+        curve = primitive->curve;
+        fprintf(fp, "<path fill=\"none\" stroke=\"#%06x\" stroke-width=\"%d\" "
+            "stroke-linecap=\"square\" d=\"M%.7g,%.7g Q%.7g,%.7g %.7g,%.7g\"/>\n",
+            primitive->color, primitive->str,
+            svgX(curve->x, primitive->str),
+            svgY(params, curve->y, primitive->str),
+            svgX(curve->x + curve->v_x * curve->t_exit / 2, primitive->str),
+            svgY(params, curve->y + curve->v_y * curve->t_exit / 2,
+            primitive->str),
+            svgX(curveX(curve, curve->t_exit), primitive->str),
+            svgY(params, curveY(curve, curve->t_exit), primitive->str));
+        break;
+      case PRIM_FLIGHT:
+        startSvgPolyline(primitive, fp);
+        cursor = *primitive->flight;
+        fprintf(fp, "%.7g,%.7g", svgX(cursor.x, primitive->str),
+            svgY(params, cursor.y, primitive->str));
+        while(nextSample(&cursor, &x, &y))
+          fprintf(fp, " %.7g,%.7g", svgX(x, primitive->str),
+              svgY(params, y, primitive->str));
+        fprintf(fp, "\"/>\n");
+        break;
+    }
+  }
+  fprintf(fp, "</svg>\n");
+  return 0;
+}
+
+// Checks that the file is a bottom-up, uncompressed 24 bit bitmap whose
+// pixel array fits into file_size bytes
+int checkBitMap(BitMap *bmap, uint64_t file_size)
+{
+  BitMapInfoHeader *info = &bmap->bit_map_info_header;
+
+  if(file_size < sizeof(BitMap) || bmap->file_header.signature != TYPE ||
+      info->dib_header_size < sizeof(BitMapInfoHeader) ||
+      bmap->file_header.fileoffset_to_pixelarray < sizeof(BitMap) ||
+      (int32_t) info->width <= 0 || (int32_t) info->height <= 0 ||
+      info->planes != PLANES || info->bits_per_pixel != BITS_PER_PIXEL ||
+      info->compression != COMPRESSION)
+    return 7;
+  if(bmap->file_header.fileoffset_to_pixelarray + (uint64_t) info->height *
+      rowStride(info->width, BITS_PER_PIXEL) > file_size)
+    return 7;
+  return 0;
+}
+
+// Takes the resolution of the bitmap a shot is composited onto
+int readBitMapSize(char *file_name, Parameter *params)
+{
+  int fd = 0;
+  BitMap bmap;
+  struct stat file_stat;
+
+  memset(&bmap, 0, sizeof(BitMap));
+  if((fd = open(file_name, O_RDONLY)) < 0)
+    return 3;
+  if(fstat(fd, &file_stat) != 0 || read(fd, &bmap, sizeof(BitMap)) !=
+      sizeof(BitMap) || checkBitMap(&bmap, file_stat.st_size) != 0)
+  {
+    close(fd);
+    return 7;
+  }
+  close(fd);
+  params->width = bmap.bit_map_info_header.width;
+  params->height = bmap.bit_map_info_header.height;
+  return 0;
+}
+
+// Draws the scene, which holds only trajectories, straight into the mapped
+// pixels of an existing bitmap, so just the pages it touches are read and
+// written back
+int compositeBitMap(char *bmp_name, Parameter *params, Options *options,
+    RenderContext *context)
+{
+  int fd = 0;
+  int status = 0;
+  uint8_t *map = NULL;
+  BitMap bmap;
+  FrameBuffer view;
+  struct stat file_stat;
+
+  if(unshareFile(bmp_name, 1) != 0 || (fd = open(bmp_name, O_RDWR)) < 0)
+    return 3;
+  if(fstat(fd, &file_stat) != 0 ||
+      (uint64_t) file_stat.st_size < sizeof(BitMap))
+  {
+    close(fd);
+    return 7;
+  }
+  if((map = (uint8_t *) mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0)) == MAP_FAILED)
+  {
+    close(fd);
+    return 3;
+  }
+  close(fd);
+  memcpy(&bmap, map, sizeof(BitMap));
+  if((status = checkBitMap(&bmap, file_stat.st_size)) == 0 &&
+      (bmap.bit_map_info_header.width != params->width ||
+      bmap.bit_map_info_header.height != params->height))
+    status = 7;
+
+  if(!status)
+  {
+    memset(&view, 0, sizeof(FrameBuffer));
+    view.pixels = map + bmap.file_header.fileoffset_to_pixelarray;
+    view.colors = context->scene.palette.colors;
+    view.width = params->width;
+    view.height = params->height;
+    view.stride = rowStride(params->width, BITS_PER_PIXEL);
+    view.rows = params->height;
+    status = drawScene(&context->scene, options->threads, &view,
+        &context->line_stats);
+  }
+  if(munmap(map, file_stat.st_size) != 0 && !status)
+    return 3;
+  return status;
+}
+
+void initLayerCache(LayerCache *cache, char *dir)
+{
+  memset(cache, 0, sizeof(LayerCache));
+  cache->dir = dir;
+  pthread_mutex_init(&cache->lock, NULL);
+}
+
+void freeLayer(Layer *layer)
+{
+  if(layer->map != NULL)
+    munmap(layer->map, layer->map_size);
+  else
+    free(layer->pixels);
+  free(layer);
+}
+
+void freeLayerCache(LayerCache *cache)
+{
+  int cur_layer = 0;
+
+  for(cur_layer = 0; cur_layer < cache->count; cur_layer++)
+    freeLayer(cache->layers[cur_layer]);
+  cache->count = 0;
+  pthread_mutex_destroy(&cache->lock);
+}
+
+// A layer is only usable with the palette the scene gives its colors
+int matchLayer(Layer *layer, Parameter *params, Scene *scene)
+{
+  return layer->width == (int) params->width &&
+      layer->height == (int) params->height &&
+      layer->v_angle == params->v_angle &&
+      layer->colors == scene->layer_colors && memcmp(layer->palette,
+      scene->palette.colors, sizeof(uint32_t) * layer->colors) == 0;
+}
+
+// Blob of the layer key in the cache directory, the angle by its bits
+char *layerPath(LayerCache *cache, Parameter *params)
+{
+  char *path = NULL;
+  uint32_t angle = 0;
+
+  memcpy(&angle, &params->v_angle, sizeof(uint32_t));
+  if(asprintf(&path, "%s/layer_%ux%u_%08x.bin", cache->dir, params->width,
+      params->height, angle) < 0)
+    return NULL;
+  return path;
+}
+
+// Maps the blob of a layer, which is shared with other runs reading it. The
+// rows are copied at the stride of the frame, so a blob with another one is
+// as unusable as a truncated one.
+int loadLayer(char *path, Layer *layer)
+{
+  int fd = 0;
+  LayerHeader header;
+  struct stat file_stat;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+    return 3;
+  if(fstat(fd, &file_stat) != 0 || read(fd, &header, sizeof(LayerHeader)) !=
+      sizeof(LayerHeader) || memcmp(header.magic, LAYER_MAGIC, 8) != 0 ||
+      header.colors > LAYER_COLORS || header.stride !=
+      (uint32_t) rowStride(header.width, 8) || (uint64_t) file_stat.st_size !=
+      sizeof(LayerHeader) + (uint64_t) header.stride * header.height ||
+      (layer->map = (uint8_t *) mmap(NULL, file_stat.st_size, PROT_READ,
+      MAP_SHARED, fd, 0)) == MAP_FAILED)
+  {
+    layer->map = NULL;
+    close(fd);
+    return 7;
+  }
+  close(fd);
+  layer->width = header.width;
+  layer->height = header.height;
+  layer->v_angle = header.v_angle;
+  layer->stride = header.stride;
+  layer->colors = header.colors;
+  memcpy(layer->palette, header.palette, sizeof(layer->palette));
+  layer->pixels = layer->map + sizeof(LayerHeader);
+  layer->map_size = file_stat.st_size;
+  return 0;
+}
+
+// Writes the blob under a temporary name and renames it, so that other runs
+// never see a partial one. The blob is readable by all, so that the runs of
+// other users share it as well.
+int saveLayer(char *path, Layer *layer)
+{
+  char *temp_path = NULL;
+  int fd = 0;
+  int status = 0;
+  FILE *fp = NULL;
+  LayerHeader header;
+
+  memset(&header, 0, sizeof(LayerHeader));
+  memcpy(header.magic, LAYER_MAGIC, 8);
+  header.width = layer->width;
+  header.height = layer->height;
+  header.v_angle = layer->v_angle;
+  header.stride = layer->stride;
+  header.colors = layer->colors;
+  memcpy(header.palette, layer->palette, sizeof(header.palette));
+  if(asprintf(&temp_path, "%s.XXXXXX", path) < 0)
+    return 2;
+  if((fd = mkstemp(temp_path)) < 0 || (fp = fdopen(fd, "wb")) == NULL)
+  {
+    if(fd >= 0)
+      close(fd);
+    free(temp_path);
+    return 3;
+  }
+  fwrite(&header, 1, sizeof(LayerHeader), fp);
+  fwrite(layer->pixels, layer->stride, layer->height, fp);
+  if(fchmod(fd, 0644) != 0)
+    status = 3;
+  if((ferror(fp) | (fclose(fp) != 0)) || status ||
+      rename(temp_path, path) != 0)
+  {
+    unlink(temp_path);
+    status = 3;
+  }
+  free(temp_path);
+  return status;
+}
+
+// Reads the layer of the scene from its blob or draws it, and saves what was
+// drawn when there is a cache directory
+Layer *createLayer(LayerCache *cache, Parameter *params, int threads,
+    Scene *scene)
+{
+  Layer *layer = NULL;
+  Scene static_scene = *scene;
+  FrameBuffer frame;
+  LineStats stats;
+  char *path = NULL;
+
+  if((layer = (Layer *) calloc(1, sizeof(Layer))) == NULL)
+    return NULL;
+  if(cache->dir != NULL && (path = layerPath(cache, params)) != NULL &&
+      loadLayer(path, layer) == 0)
+  {
+    if(matchLayer(layer, params, scene))
+    {
+      free(path);
+      return layer;
+    }
+    munmap(layer->map, layer->map_size);
+    memset(layer, 0, sizeof(Layer));
+  }
+
+  layer->width = params->width;
+  layer->height = params->height;
+  layer->v_angle = params->v_angle;
+  layer->stride = rowStride(params->width, 8);
+  layer->colors = scene->layer_colors;
+  memcpy(layer->palette, scene->palette.colors, sizeof(uint32_t) *
+      layer->colors);
+  memset(&frame, 0, sizeof(FrameBuffer));
+  frame.width = params->width;
+  frame.height = frame.rows = params->height;
+  frame.stride = layer->stride;
+  memset(&stats, 0, sizeof(LineStats));
+  static_scene.count = scene->layer_count;
+  static_scene.first = 0;
+  if((layer->pixels = frame.pixels = (uint8_t *) malloc((size_t)
+      layer->stride * layer->height)) == NULL ||
+      drawScene(&static_scene, threads, &frame, &stats) != 0)
+  {
+    free(path);
+    freeLayer(layer);
+    return NULL;
+  }
+  // a layer that can't be saved is still good for this run
+  if(path != NULL)
+    saveLayer(path, layer);
+  free(path);
+  return layer;
+}
+
+// The static layer of the scene, taken from the cache or created and added
+// to it. NULL means the layer is drawn with the rest of the scene.
+Layer *acquireLayer(LayerCache *cache, Parameter *params, int threads,
+    Scene *scene)
+{
+  Layer *layer = NULL;
+  Layer *created = NULL;
+  size_t size = (size_t) rowStride(params->width, 8) * params->height;
+  int cur_layer = 0;
+  int slot = 0;
+
+  if(scene->layer_count == 0 || scene->layer_colors > LAYER_COLORS ||
+      (uint64_t) rowStride(params->width, 8) * params->height >
+      LAYER_CACHE_SIZE)
+    return NULL;
+  // drawn without the lock, a layer is added twice at worst
+  while(1)
+  {
+    pthread_mutex_lock(&cache->lock);
+    for(cur_layer = 0; cur_layer < cache->count && layer == NULL; cur_layer++)
+      if(matchLayer(cache->layers[cur_layer], params, scene))
+        layer = cache->layers[cur_layer];
+    if(layer == NULL && created != NULL)
+    {
+      // the least recently used layers no render copies make room
+      while(cache->count == LAYER_SLOTS ||
+          cache->size + size > LAYER_CACHE_SIZE)
+      {
+        for(slot = -1, cur_layer = 0; cur_layer < cache->count; cur_layer++)
+          if(cache->layers[cur_layer]->refs == 0 && (slot < 0 ||
+              cache->layers[cur_layer]->used < cache->layers[slot]->used))
+            slot = cur_layer;
+        if(slot < 0)
+          break;
+        cache->size -= (size_t) cache->layers[slot]->stride *
+            cache->layers[slot]->height;
+        freeLayer(cache->layers[slot]);
+        cache->layers[slot] = cache->layers[--cache->count];
+      }
+      if(cache->count < LAYER_SLOTS && cache->size + size <= LAYER_CACHE_SIZE)
+      {
+        cache->layers[cache->count++] = created;
+        cache->size += size;
+        created->cached = 1;
+      }
+      layer = created;
+      created = NULL;
+    }
+    if(layer != NULL)
+    {
+      layer->refs++;
+      layer->used = cache->tick++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if(created != NULL)
+      freeLayer(created);
+    if(layer != NULL)
+      return layer;
+    if((created = createLayer(cache, params, threads, scene)) == NULL)
+      return NULL;
+  }
+}
+
+// Uncached layers, when the cache was full of used ones, are freed here
+void releaseLayer(LayerCache *cache, Layer *layer)
+{
+  int cached = 0;
+
+  if(layer == NULL)
+    return;
+  pthread_mutex_lock(&cache->lock);
+  layer->refs--;
+  cached = layer->cached;
+  pthread_mutex_unlock(&cache->lock);
+  if(!cached)
+    freeLayer(layer);
+}
+
+// Writes the scene of the context in the output format, or composites it
+int renderScene(char *bmp_name, Parameter *params, Options *options,
+    RenderContext *context)
+{
+  int curheight = 0;
+  int curband = 0;
+  int bands = 0;
+  int rows = params->height;
+  int status = 0;
+  FrameBuffer *frame = &context->frame;
+  FrameBuffer view;
+  Palette *palette = &context->scene.palette;
+  Layer *layer = NULL;
+  ShmSlot *slot = (strcmp(bmp_name, "-") == 0) ? options->slot : NULL;
+  Output output;
+  BitMap bmap;
+
+  memset(&context->line_stats, 0, sizeof(LineStats));
+  if(options->composite)
+    return compositeBitMap(bmp_name, params, options, context);
+  if(formatBits(options->format) == 4 && palette->count > 16)
+    return 6;
+  // a slot of the shared memory ring only takes uncompressed bitmaps
+  if(slot != NULL && (options->format == FORMAT_SVG || options->format ==
+      FORMAT_PNG || options->format == FORMAT_RLE8 || options->format ==
+      FORMAT_RLE4))
+    return 8;
+
+  // vector output needs no frame at all
+  if(options->format == FORMAT_SVG)
+  {
+    if((output.fp = openOutput(bmp_name, options)) == NULL)
+      return 3;
+    writeSvg(params, &context->scene, output.fp);
+    if(ferror(output.fp) | (fclose(output.fp) != 0))
+      return 3;
+    return 0;
+  }
+
+  memset(&output, 0, sizeof(Output));
+  output.format = options->format;
+  memset(&bmap, 0, sizeof(BitMap));
+  createHeader(params, options->format, palette->count, &bmap);
+
+  // only uncompressed bitmaps have a size known up front, the others and
+  // stdout are streamed
+  if(slot != NULL && (status = mapSlot(options->ring, slot, params, &bmap,
+      palette, &output)) != 0)
+    return status;
+  if(options->map && options->format != FORMAT_PNG &&
+      !bmap.bit_map_info_header.compression && strcmp(bmp_name, "-") != 0 &&
+      (status = mapOutput(bmp_name, params, &bmap, palette, &output)) != 0)
+    return status;
+
+  // a band bounds the memory to width * band rows, independent of height
+  if(options->band_rows > 0 && options->band_rows < rows)
+    rows = options->band_rows;
+  if(output.map != NULL && output.format == FORMAT_BMP8)
+  {
+    // the bands are windows into the mapped pixel array
+    memset(&view, 0, sizeof(FrameBuffer));
+    view.width = params->width;
+    view.height = params->height;
+    view.stride = rowStride(params->width, 8);
+    frame = &view;
+  }
+  else if(resizeFrameBuffer(params, rows, frame) == NULL ||
+      (output.row = (uint8_t *) calloc(1, rowStride(params->width,
+      BITS_PER_PIXEL))) == NULL)
+  {
+    if(output.map != NULL && slot == NULL)
+      munmap(output.map, output.map_size);
+    return 2;
+  }
+
+  if(output.map == NULL)
+  {
+    if((output.fp = openOutput(bmp_name, options)) == NULL)
+    {
+      //Could not write file
+      free(output.row);
+      return 3;
+
+    }
+    if(options->format == FORMAT_PNG)
+    {
+      if(initPng(&output.png, params, palette, options->level, output.fp) != 0)
+      {
+        free(output.row);
+        fclose(output.fp);
+        return 2;
+      }
+    }
+    else if(!bmap.bit_map_info_header.compression)
+    {
+      fwrite(&bmap, 1, sizeof(BitMap), output.fp);
+      if(options->format != FORMAT_BMP24)
+        fwrite(palette->colors, 4, palette->count, output.fp);
+    }
+    // a compressed bitmap to a file is streamed and its header written
+    // again once the size is known, stdout gets it in one piece
+    else if(strcmp(bmp_name, "-") != 0)
+    {
+      output.patch = 1;
+      fwrite(&bmap, 1, sizeof(BitMap), output.fp);
+      fwrite(palette->colors, 4, palette->count, output.fp);
+    }
+  }
+
+  // background and cannon are copied from the layer when there is one
+  if(options->layers != NULL)
+    layer = acquireLayer(options->layers, params, options->threads,
+        &context->scene);
+  context->scene.first = (layer != NULL) ? context->scene.layer_count : 0;
+
+  // BMP rows are stored bottom-up, so bands are finished in file order,
+  // PNG takes them from the top
+  bands = (frame->height + rows - 1) / rows;
+  for(curband = 0; curband < bands; curband++)
+  {
+    curheight = ((options->format == FORMAT_PNG) ? bands - 1 - curband :
+        curband) * rows;
+    if(frame == &view)
+      view.pixels = output.pixels + (size_t) curheight * view.stride;
+    frame->y_offset = curheight;
+    frame->rows = (frame->height - curheight < rows) ?
+        frame->height - curheight : rows;
+    if(layer != NULL)
+      memcpy(frame->pixels, layer->pixels + (size_t) curheight * frame->stride,
+          (size_t) frame->rows * frame->stride);
+    if((status = drawScene(&context->scene, options->threads, frame,
+        &context->line_stats)) != 0 || (status = writeRows(frame, palette,
+        &output)) != 0)
+      break;
+  }
+  releaseLayer(options->layers, layer);
+  context->scene.first = 0;
+  if(options->format == FORMAT_PNG)
+  {
+    if(!status)
+      finishPng(&output.png);
+    freePng(&output.png);
+  }
+
+  // the header of compressed data needs its size
+  if(!status && bmap.bit_map_info_header.compression)
+  {
+    if(reserveBytes(&output.rle, 2) == NULL)
+      status = 2;
+    else
+    {
+      output.rle.data[output.rle.size - 1] = 1;
+      bmap.bit_map_info_header.image_size = output.encoded + output.rle.size;
+      bmap.file_header.file_size += output.encoded + output.rle.size;
+      if(output.patch)
+      {
+        fwrite(output.rle.data, 1, output.rle.size, output.fp);
+        if(fseek(output.fp, 0, SEEK_SET) != 0)
+          status = 3;
+        fwrite(&bmap, 1, sizeof(BitMap), output.fp);
+      }
+      else
+      {
+        fwrite(&bmap, 1, sizeof(BitMap), output.fp);
+        fwrite(palette->colors, 4, palette->count, output.fp);
+        fwrite(output.rle.data, 1, output.rle.size, output.fp);
+      }
+    }
+  }
+  free(output.rle.data);
+  free(output.row);
+  // the caller publishes the slot
+  if(slot != NULL)
+  {
+    slot->size = output.map_size;
+    return status;
+  }
+  if(output.map != NULL)
+  {
+    if(munmap(output.map, output.map_size) != 0 && !status)
+      return 3;
+    return status;
+  }
+  if((ferror(output.fp) | (fclose(output.fp) != 0)) && !status)
+    return 3;
+  return status;
+}
+
+int drawBitMap(char *bmp_name, int **points, int *counter, Parameter *params,
+    Options *options, RenderContext *context)
+{
+  int status = 0;
+  Curve *curve = (options->draw == DRAW_PARABOLA) ? &context->curve : NULL;
+  Flight *flight = (options->draw == DRAW_FUSED) ? &context->flight : NULL;
+
+  // a composited shot is drawn without background and cannon
+  if(options->composite)
+  {
+    resetScene(&context->scene);
+    status = addTrajectory(points, counter, curve, flight, &context->scene);
+  }
+  else
+    status = buildScene(points, counter, params, curve, flight,
+        &context->scene);
+  if(status != 0)
+    return status;
+  return renderScene(bmp_name, params, options, context);
+}
+
+Parameter* setStandard(Parameter *params, float angle, float speed)
+{
+
+  params->height = 320;
+  params->width = 320;
+  params->pps = 5;
+  params->gravitation = 9.798;
+  params->wind_angle = 0;
+  params->wind_force = 0;
+  params->v_angle = angle;
+  params->v_speed = speed;
+  params->tolerance = 0;
+  return params;
+}
+
+char *statusMessage(int status)
+{
+  switch(status)
+  {
+    case 0:
+      return MSG_OK;
+    case 1:
+      return MSG_JOB;
+    case 2:
+      return MSG_OOM;
+    case 3:
+      return MSG_WRITE;
+    case 4:
+      return MSG_SPEED;
+    case 6:
+      return MSG_COLORS;
+    case 7:
+      return MSG_BITMAP;
+    case 8:
+      return MSG_SLOT;
+    case 9:
+      return MSG_SAMPLE_LIMIT;
+  }
+  return MSG_PARAMETER;
+}
+
+void freeRenderContext(RenderContext *context)
+{
+  free(context->points[0]);
+  free(context->points[1]);
+  context->points[0] = NULL;
+  context->points[1] = NULL;
+  context->point_capacity = 0;
+  freeScene(&context->scene);
+  freeFrameBuffer(&context->frame);
+}
+
+int renderShot(char *bmp_name, Parameter *params, Options *options,
+    RenderContext *context)
+{
+  int counter = 0;
+  int status = 0;
+  int *points = NULL;
+
+  if(params->v_speed <= 0)
+    return 4;
+  if(options->composite && (status = readBitMapSize(bmp_name, params)) != 0)
+    return status;
+  if(params->width == 0 || params->height == 0 || params->pps == 0)
+    return 1;
+
+  // the parabola is drawn straight from the parameters, without samples
+  if(options->draw == DRAW_PARABOLA)
+  {
+    setCurve(params, &context->curve);
+    context->point_count = 0;
+    return drawBitMap(bmp_name, context->points, &counter, params, options,
+        context);
+  }
+
+  // the arrays only ever grow, a batch reuses them for the following shots
+  if((counter = sampleCount(params)) < 0)
+    return 9;
+
+  // the samples are generated while rasterizing, none are stored
+  if(options->draw == DRAW_FUSED)
+  {
+    startFlight(params, counter, &context->flight);
+    context->point_count = counter;
+    return drawBitMap(bmp_name, context->points, &counter, params, options,
+        context);
+  }
+  if(counter > context->point_capacity)
+  {
+    if((points = (int *) realloc(context->points[0], sizeof(int) * counter))
+        == NULL)
+      return 2;
+    context->points[0] = points;
+    if((points = (int *) realloc(context->points[1], sizeof(int) * counter))
+        == NULL)
+      return 2;
+    context->points[1] = points;
+    context->point_capacity = counter;
+  }
+  context->points[0][0] = params->width / 2;
+  context->points[1][0] = params->height / 2;
+  if((status = calculation(context->points, &counter, params)) != 0)
+    return status;
+  context->point_count = counter;
+  return drawBitMap(bmp_name, context->points, &counter, params, options,
+      context);
+}
+
+// Colors of the palette in the byte order of the animation frames: RGB for
+// PPM, Y, Cb and Cr of BT.601 studio range for the planes of Y4M
+void convertPalette(Palette *palette, int animate, uint32_t *colors)
+{
+  int cur_color = 0;
+  int red = 0;
+  int green = 0;
+  int blue = 0;
+
+  for(cur_color = 0; cur_color < palette->count; cur_color++)
+  {
+    red = (palette->colors[cur_color] >> 16) & 0xFF;
+    green = (palette->colors[cur_color] >> 8) & 0xFF;
+    blue = palette->colors[cur_color] & 0xFF;
+    if(animate == ANIMATE_PPM)
+      colors[cur_color] = red | green << 8 | blue << 16;
+    else
+      colors[cur_color] = (((66 * red + 129 * green + 25 * blue + 128) >> 8)
+          + 16) | (((-38 * red - 74 * green + 112 * blue + 128) >> 8) + 128)
+          << 8 | (((112 * red - 94 * green - 18 * blue + 128) >> 8) + 128)
+          << 16;
+  }
+}
+
+// Writes one frame, numbered bitmaps each to a file of their own unless
+// they go to stdout
+int writeFrame(char *file_name, int number, BitMap *bmap, Options *options,
+    FrameBuffer *frame, FILE *fp)
+{
+  char *frame_name = NULL;
+  size_t size = (size_t) frame->stride * frame->rows;
+
+  if(options->animate == ANIMATE_Y4M)
+  {
+    fprintf(fp, "FRAME\n");
+    size = frame->plane_size * 3;
+  }
+  else if(options->animate == ANIMATE_PPM)
+    fprintf(fp, "P6\n%d %d\n255\n", frame->width, frame->height);
+  else if(fp == NULL)
+  {
+    if(asprintf(&frame_name, "%s%05d.bmp", file_name, number) < 0)
+      return 2;
+    fp = (unshareFile(frame_name, 0) == 0) ? fopen(frame_name, "wb") : NULL;
+    free(frame_name);
+    if(fp == NULL)
+      return 3;
+    fwrite(bmap, 1, sizeof(BitMap), fp);
+    fwrite(frame->pixels, 1, size, fp);
+    if(ferror(fp) | (fclose(fp) != 0))
+      return 3;
+    return 0;
+  }
+  else
+    fwrite(bmap, 1, sizeof(BitMap), fp);
+  fwrite(frame->pixels, 1, size, fp);
+  return ferror(fp) ? 3 : 0;
+}
+
+// Renders the flight as one frame per sample into a persistent frame. The
+// background and cannon are drawn once, every further frame only adds the
+// segment to its newest sample, so only the output grows with the area.
+int renderAnimation(char *file_name, Parameter *params, Options *options,
+    RenderContext *context)
+{
+  Scene *scene = &context->scene;
+  Flight flight;
+  FrameBuffer frame;
+  SpanList spans;
+  BitMap bmap;
+  FILE *fp = NULL;
+  uint32_t colors[PALETTE_SIZE];
+  int point_x[2];
+  int point_y[2];
+  int *points[2] = {point_x, point_y};
+  int counter = 0;
+  int cur_frame = 0;
+  int index = 0;
+  int status = 0;
+
+  memset(&context->line_stats, 0, sizeof(LineStats));
+  if(params->v_speed <= 0)
+    return 4;
+  if(params->width == 0 || params->height == 0 || params->pps == 0)
+    return 1;
+  if((counter = sampleCount(params)) < 0)
+    return 9;
+  startFlight(params, counter, &flight);
+  context->point_count = counter;
+  resetScene(scene);
+  if((status = addPrimitive(scene, PRIM_BACKGROUND, 0x60D0FF, 0, NULL, 0) |
+      drawCannon(params, scene)) != 0)
+    return status;
+  if((index = paletteIndex(&scene->palette, 0xFF0000)) < 0)
+    return 6;
+
+  memset(&frame, 0, sizeof(FrameBuffer));
+  frame.width = params->width;
+  frame.height = frame.rows = params->height;
+  frame.colors = colors;
+  if(options->animate == ANIMATE_BMP)
+  {
+    frame.colors = scene->palette.colors;
+    frame.stride = rowStride(params->width, BITS_PER_PIXEL);
+    memset(&bmap, 0, sizeof(BitMap));
+    createHeader(params, FORMAT_BMP24, 0, &bmap);
+  }
+  else if(options->animate == ANIMATE_PPM)
+    frame.stride = params->width * 3;
+  else
+  {
+    frame.stride = params->width;
+    frame.plane_size = (size_t) params->width * params->height;
+  }
+  frame.top_down = options->animate != ANIMATE_BMP;
+  convertPalette(&scene->palette, options->animate, colors);
+  if((frame.pixels = (uint8_t *) malloc((size_t) frame.stride * frame.rows *
+      (frame.plane_size ? 3 : 1))) == NULL)
+    return 2;
+  // drawn once and as a single band, bands assume bottom-up rows
+  if((status = drawScene(scene, 1, &frame, &context->line_stats)) != 0)
+  {
+    free(frame.pixels);
+    return status;
+  }
+
+  if((options->animate != ANIMATE_BMP || strcmp(file_name, "-") == 0) &&
+      (fp = openOutput(file_name, options)) == NULL)
+  {
+    free(frame.pixels);
+    return 3;
+  }
+  // one frame per sample is real time at pps frames per second
+  if(options->animate == ANIMATE_Y4M)
+    fprintf(fp, "YUV4MPEG2 W%d H%d F%u:1 Ip A1:1 C444\n", params->width,
+        params->height, params->pps);
+
+  memset(&spans, 0, sizeof(SpanList));
+  point_x[1] = flight.x;
+  point_y[1] = flight.y;
+  for(cur_frame = 0; !status && cur_frame < counter; cur_frame++)
+  {
+    if(cur_frame > 0)
+    {
+      point_x[0] = point_x[1];
+      point_y[0] = point_y[1];
+      nextSample(&flight, &point_x[1], &point_y[1]);
+      if(addLineSpans(points, 2, LINE_STRENGTH, &frame, &spans) != 0)
+      {
+        status = 2;
+        break;
+      }
+      fillSpans(&spans, index, &frame);
+    }
+    status = writeFrame(file_name, cur_frame, &bmap, options, &frame, fp);
+  }
+  context->line_stats.filled_pixels += spans.stats.filled_pixels;
+  context->line_stats.brush_pixels += spans.stats.brush_pixels;
+  free(spans.spans);
+  free(frame.pixels);
+  if(fp != NULL && (ferror(fp) | (fclose(fp) != 0)) && !status)
+    return 3;
+  return status;
+}
+
+// Everything the output of a shot depends on, floats in exact hexadecimal.
+// Values that can't change the output are normalized: negative zeros, the
+// wind angle without wind, pps with adaptive sampling, the PNG level of
+// other formats and fused drawing, which gives the pixels of the polyline.
+char *cacheKey(Parameter *params, Options *options)
+{
+  char *key = NULL;
+
+  if(asprintf(&key, "assa %d\nwidth %u\nheight %u\npps %u\ngravitation %a\n"
+      "wind_angle %a\nwind_force %a\nangle %a\nspeed %a\ntolerance %a\n"
+      "format %d\ndraw %d\nlevel %d\n", CACHE_VERSION, params->width,
+      params->height, (params->tolerance > 0) ? 0 : params->pps,
+      params->gravitation + 0.0, (params->wind_force != 0) ?
+      params->wind_angle + 0.0 : 0.0, params->wind_force + 0.0,
+      params->v_angle + 0.0, params->v_speed + 0.0, params->tolerance + 0.0,
+      options->format, (options->draw == DRAW_PARABOLA) ? DRAW_PARABOLA :
+      DRAW_POLYLINE, (options->format == FORMAT_PNG) ? options->level : 0)
+      < 0)
+    return NULL;
+  return key;
+}
+
+// 64 bit FNV-1a
+uint64_t hashKey(const char *key)
+{
+  uint64_t hash = 0xCBF29CE484222325ULL;
+
+  for(; *key; key++)
+    hash = (hash ^ (uint8_t) *key) * 0x100000001B3ULL;
+  return hash;
+}
+
+// Puts the cached result, open as from_fd, in place of the output file: as
+// a reflink where the file system shares blocks, else as a copy. Either way
+// the output is an inode of its own with a writable mode, a hard link would
+// share the read-only mode of the entry. The output is replaced in one
+// rename.
+int deliverResult(int from_fd, char *bmp_name, Options *options)
+{
+  char *temp_path = NULL;
+  int to_fd = -1;
+  int cloned = 0;
+  int status = 0;
+
+  if(strcmp(bmp_name, "-") == 0 && options->memory != NULL)
+    return copyStream(from_fd, openOutput("-", options));
+  if(strcmp(bmp_name, "-") == 0)
+    return copyFile(from_fd, options->output_fd);
+  if(asprintf(&temp_path, "%s.XXXXXX", bmp_name) < 0)
+    return 2;
+  if((to_fd = mkstemp(temp_path)) < 0)
+  {
+    free(temp_path);
+    return 3;
+  }
+#ifdef FICLONE
+  cloned = ioctl(to_fd, FICLONE, from_fd) == 0 && fchmod(to_fd, 0644) == 0;
+#endif
+  if(!cloned && (copyFile(from_fd, to_fd) != 0 || fchmod(to_fd, 0644) != 0))
+    status = 3;
+  if(close(to_fd) != 0)
+    status = 3;
+  if(!status && rename(temp_path, bmp_name) != 0)
+    status = 3;
+  if(status)
+    unlink(temp_path);
+  free(temp_path);
+  return status;
+}
+
+// Whether the key file holds exactly key, so a hash collision is a miss
+int matchKey(char *key_path, char *key)
+{
+  char buffer[512];
+  size_t size = strlen(key);
+  ssize_t length = 0;
+  int fd = 0;
+
+  if(size >= sizeof(buffer) || (fd = open(key_path, O_RDONLY)) < 0)
+    return 0;
+  length = read(fd, buffer, sizeof(buffer));
+  close(fd);
+  return length == (ssize_t) size && memcmp(buffer, key, size) == 0;
+}
+
+// Writes the file under a temporary name and renames it, so that other runs
+// see it completely or not at all
+int publishFile(char *path, char *data, size_t size)
+{
+  char *temp_path = NULL;
+  int fd = 0;
+  int status = 0;
+
+  if(asprintf(&temp_path, "%s.XXXXXX", path) < 0)
+    return 2;
+  if((fd = mkstemp(temp_path)) < 0)
+  {
+    free(temp_path);
+    return 3;
+  }
+  if(write(fd, data, size) != (ssize_t) size || fchmod(fd, 0444) != 0 ||
+      (close(fd) != 0) || rename(temp_path, path) != 0)
+  {
+    unlink(temp_path);
+    status = 3;
+  }
+  free(temp_path);
+  return status;
+}
+
+int compareCacheEntries(const void *first, const void *second)
+{
+  const CacheEntry *entry_a = (const CacheEntry *) first;
+  const CacheEntry *entry_b = (const CacheEntry *) second;
+
+  if(entry_a->used != entry_b->used)
+    return (entry_a->used < entry_b->used) ? -1 : 1;
+  return 0;
+}
+
+// Counts the results in the directory and removes the least recently used
+// ones, by modification time, until they fit into limit bytes. Temporary
+// files that were not renamed for CACHE_TEMP_AGE seconds were left by runs
+// that died and are removed as well.
+int scanCache(char *dir, uint64_t limit, CacheStats *stats)
+{
+  DIR *directory = NULL;
+  struct dirent *item = NULL;
+  struct stat file_stat;
+  CacheEntry *entries = NULL;
+  CacheEntry *grown = NULL;
+  char *path = NULL;
+  size_t length = 0;
+  int count = 0;
+  int capacity = 0;
+  int cur_entry = 0;
+  int status = 0;
+
+  if((directory = opendir(dir)) == NULL)
+    return 3;
+  stats->bytes = 0;
+  while((item = readdir(directory)) != NULL)
+  {
+    // results are named by their 16 digit hash and .img, temporary files
+    // are render.XXXXXX and HASH.key.XXXXXX
+    length = strlen(item->d_name);
+    if((strncmp(item->d_name, "render.", 7) == 0 || (length == 27 &&
+        strncmp(item->d_name + 16, ".key.", 5) == 0)) &&
+        fstatat(dirfd(directory), item->d_name, &file_stat, 0) == 0 &&
+        file_stat.st_mtime < time(NULL) - CACHE_TEMP_AGE)
+      unlinkat(dirfd(directory), item->d_name, 0);
+    if(length != 20 || strcmp(item->d_name + 16, ".img") != 0 ||
+        fstatat(dirfd(directory), item->d_name, &file_stat, 0) != 0)
+      continue;
+    if(count == capacity)
     {
-      if((points[0] = (int *) realloc(points[0], (cur_x + 10)*(sizeof(int))))
-          == NULL)
+      if((grown = (CacheEntry *) realloc(entries, sizeof(CacheEntry) *
+          (capacity + SCENE_CHUNK))) == NULL)
       {
-        printf(MSG_OOM);
-        return 2;
+        status = 2;
+        break;
+      }
+      entries = grown;
+      capacity += SCENE_CHUNK;
+    }
+    if((entries[count].name = strdup(item->d_name)) == NULL)
+    {
+      status = 2;
+      break;
+    }
+    entries[count].used = file_stat.st_mtime;
+    entries[count].size = file_stat.st_size;
+    stats->bytes += file_stat.st_size;
+    count++;
+  }
+  closedir(directory);
+
+  if(!status && stats->bytes > limit)
+    qsort(entries, count, sizeof(CacheEntry), compareCacheEntries);
+  for(cur_entry = 0; cur_entry < count; cur_entry++)
+  {
+    if(!status && stats->bytes > limit &&
+        asprintf(&path, "%s/%s", dir, entries[cur_entry].name) >= 0)
+    {
+      unlink(path);
+      strcpy(path + strlen(path) - 4, ".key");
+      unlink(path);
+      free(path);
+      stats->bytes -= entries[cur_entry].size;
+      stats->evictions++;
+      entries[cur_entry].size = UINT64_MAX;
+    }
+    free(entries[cur_entry].name);
+  }
+  for(stats->entries = 0, cur_entry = 0; cur_entry < count; cur_entry++)
+    if(entries[cur_entry].size != UINT64_MAX)
+      stats->entries++;
+  free(entries);
+  return status;
+}
+
+// Counts a hit (1) or miss (0) of size bytes in the stats file of the cache.
+// The directory is only scanned when the results outgrow the cache, when the
+// file has no totals yet or when scan is set. The file lock keeps the
+// counters and the eviction consistent between threads and processes.
+int updateCache(Options *options, int hit, uint64_t size, int scan,
+    CacheStats *stats)
+{
+  char *path = NULL;
+  char buffer[160];
+  ssize_t length = 0;
+  int fd = 0;
+  int fields = 0;
+  int status = 0;
+
+  memset(stats, 0, sizeof(CacheStats));
+  if(asprintf(&path, "%s/stats", options->cache_dir) < 0)
+    return 2;
+  fd = open(path, O_RDWR | O_CREAT, 0644);
+  free(path);
+  if(fd < 0 || flock(fd, LOCK_EX) != 0)
+  {
+    if(fd >= 0)
+      close(fd);
+    return 3;
+  }
+  if((length = pread(fd, buffer, sizeof(buffer) - 1, 0)) > 0)
+  {
+    buffer[length] = '\0';
+    fields = sscanf(buffer, "%llu %llu %llu %llu %d",
+        (unsigned long long *) &stats->hits,
+        (unsigned long long *) &stats->misses,
+        (unsigned long long *) &stats->evictions,
+        (unsigned long long *) &stats->bytes, &stats->entries);
+  }
+  if(hit == 1)
+    stats->hits++;
+  else if(hit == 0)
+  {
+    // a miss that failed published no result
+    stats->misses++;
+    stats->bytes += size;
+    stats->entries += size != 0;
+  }
+  if(fields < 5 || scan || stats->bytes > options->cache_size)
+    status = scanCache(options->cache_dir, options->cache_size, stats);
+  length = snprintf(buffer, sizeof(buffer), "%llu %llu %llu %llu %d\n",
+      (unsigned long long) stats->hits, (unsigned long long) stats->misses,
+      (unsigned long long) stats->evictions,
+      (unsigned long long) stats->bytes, stats->entries);
+  if(ftruncate(fd, 0) != 0 || pwrite(fd, buffer, length, 0) != length)
+    status = 3;
+  close(fd);
+  return status;
+}
+
+// Renders the shot through the result cache of options->cache_dir: a result
+// with the same key is linked to the output, anything else is rendered into
+// the cache, published and then linked. Composites depend on the bitmap they
+// are drawn onto and bypass the cache.
+int renderCached(char *bmp_name, Parameter *params, Options *options,
+    RenderContext *context, CacheStats *stats)
+{
+  struct stat file_stat;
+  uint64_t size = 0;
+  char *key = NULL;
+  char *data_path = NULL;
+  char *key_path = NULL;
+  char *temp_path = NULL;
+  uint64_t hash = 0;
+  int fd = 0;
+  int status = 0;
+
+  if(options->cache_dir == NULL || options->composite ||
+      (options->ring != NULL && strcmp(bmp_name, "-") == 0))
+    return renderShot(bmp_name, params, options, context);
+  if((key = cacheKey(params, options)) == NULL)
+    return 2;
+  hash = hashKey(key);
+  if(asprintf(&data_path, "%s/%016llx.img", options->cache_dir,
+      (unsigned long long) hash) < 0 || asprintf(&key_path, "%s/%016llx.key",
+      options->cache_dir, (unsigned long long) hash) < 0 ||
+      asprintf(&temp_path, "%s/render.XXXXXX", options->cache_dir) < 0)
+  {
+    free(key);
+    free(data_path);
+    return 2;
+  }
+
+  // the modification time of a result is its last use
+  context->point_count = 0;
+  memset(&context->line_stats, 0, sizeof(LineStats));
+  if((fd = matchKey(key_path, key) ? open(data_path, O_RDONLY) : -1) >= 0)
+  {
+    if((status = deliverResult(fd, bmp_name, options)) == 0)
+      utimensat(AT_FDCWD, data_path, NULL, 0);
+    close(fd);
+    updateCache(options, 1, 0, 0, stats);
+  }
+  else if((fd = mkstemp(temp_path)) < 0)
+    status = 3;
+  else
+  {
+    // the key goes first, a key without its result is still a miss. The
+    // result is delivered from fd, as another run may evict it right away.
+    if((status = renderShot(temp_path, params, options, context)) == 0 &&
+        (fchmod(fd, 0444) != 0 ||
+        publishFile(key_path, key, strlen(key)) != 0 ||
+        rename(temp_path, data_path) != 0))
+      status = 3;
+    if(status)
+      unlink(temp_path);
+    else
+    {
+      if(fstat(fd, &file_stat) == 0)
+        size = file_stat.st_size;
+      status = deliverResult(fd, bmp_name, options);
+    }
+    close(fd);
+    updateCache(options, 0, size, 0, stats);
+  }
+  free(key);
+  free(data_path);
+  free(key_path);
+  free(temp_path);
+  return status;
+}
+
+void printCacheStats(CacheStats *stats)
+{
+  printf(MSG_CACHE, (unsigned long long) stats->hits,
+      (unsigned long long) stats->misses, (stats->hits + stats->misses) ?
+      100.0 * stats->hits / (stats->hits + stats->misses) : 0,
+      (unsigned long long) stats->evictions,
+      (unsigned long long) stats->bytes, stats->entries);
+}
+
+int parseFormat(char *name)
+{
+  if(strcmp(name, "bmp24") == 0)
+    return FORMAT_BMP24;
+  if(strcmp(name, "bmp8") == 0)
+    return FORMAT_BMP8;
+  if(strcmp(name, "bmp4") == 0)
+    return FORMAT_BMP4;
+  if(strcmp(name, "rle8") == 0)
+    return FORMAT_RLE8;
+  if(strcmp(name, "rle4") == 0)
+    return FORMAT_RLE4;
+  if(strcmp(name, "png") == 0)
+    return FORMAT_PNG;
+  if(strcmp(name, "svg") == 0)
+    return FORMAT_SVG;
+  return -1;
+}
+
+int parseJob(char *line, Parameter *params, Options *options,
+    char **bmp_name)
+{
+  char *save = NULL;
+  char *token = NULL;
+  char *value = NULL;
+  char *end = NULL;
+  float number = 0;
+
+  if((token = strtok_r(line, " \t\r\n", &save)) == NULL)
+    return 1;
+  params->v_angle = strtof(token, &end);
+  if(*end != '\0' || (token = strtok_r(NULL, " \t\r\n", &save)) == NULL)
+    return 1;
+  params->v_speed = strtof(token, &end);
+  if(*end != '\0' || (*bmp_name = strtok_r(NULL, " \t\r\n", &save)) == NULL)
+    return 1;
+
+  // optional overrides of the config values and the format as name=value
+  while((token = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+  {
+    if((value = strchr(token, '=')) == NULL)
+      return 1;
+    *value++ = '\0';
+    if(strcmp(token, "format") == 0)
+    {
+      if((options->format = parseFormat(value)) < 0)
+        return 1;
+      continue;
+    }
+    number = strtof(value, &end);
+    if(*end != '\0' || end == value)
+      return 1;
+    if(strcmp(token, "width") == 0 && number == (int)number && number > 0)
+      params->width = (int) number;
+    else if(strcmp(token, "height") == 0 && number == (int)number &&
+        number > 0)
+      params->height = (int) number;
+    else if(strcmp(token, "pps") == 0 && number == (int)number && number > 0)
+      params->pps = (int) number;
+    else if(strcmp(token, "gravitation") == 0)
+      params->gravitation = number;
+    else if(strcmp(token, "wind_angle") == 0)
+      params->wind_angle = number;
+    else if(strcmp(token, "wind_force") == 0)
+      params->wind_force = number;
+    else if(strcmp(token, "tolerance") == 0 && number >= 0)
+      params->tolerance = number;
+    else
+      return 1;
+  }
+  return 0;
+}
+
+void *batchWorker(void *arg)
+{
+  Batch *batch = (Batch *) arg;
+  RenderContext context;
+  Parameter params;
+  Options options;
+  CacheStats stats;
+  char *line = NULL;
+  char *bmp_name = NULL;
+  char *first = NULL;
+  size_t line_size = 0;
+  ssize_t length = 0;
+  int line_number = 0;
+  int status = 0;
+
+  memset(&context, 0, sizeof(RenderContext));
+  while(1)
+  {
+    pthread_mutex_lock(&batch->lock);
+    length = getline(&line, &line_size, batch->job_file);
+    line_number = ++batch->line_number;
+    pthread_mutex_unlock(&batch->lock);
+    if(length < 0)
+      break;
+
+    // blank lines and comments are not jobs
+    first = line + strspn(line, " \t\r\n");
+    if(*first == '\0' || *first == '#')
+      continue;
+
+    params = *batch->defaults;
+    options = *batch->options;
+    bmp_name = "-";
+    status = parseJob(line, &params, &options, &bmp_name);
+    takeSlot(&options, &params, bmp_name, line_number);
+    if(status == 0)
+    {
+      // images to stdout must not interleave, they are written one by one
+      if(strcmp(bmp_name, "-") == 0 && options.ring == NULL)
+      {
+        pthread_mutex_lock(&batch->output_lock);
+        status = renderCached(bmp_name, &params, &options, &context, &stats);
+        pthread_mutex_unlock(&batch->output_lock);
+      }
+      else
+        status = renderCached(bmp_name, &params, &options, &context, &stats);
+    }
+    giveSlot(&options, status);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->jobs++;
+    if(status != 0)
+      batch->failed++;
+    printf(MSG_JOB_STATUS, line_number, bmp_name, statusMessage(status));
+    pthread_mutex_unlock(&batch->lock);
+  }
+  free(line);
+  freeRenderContext(&context);
+  return NULL;
+}
+
+int latencyBucket(uint64_t micros)
+{
+  int exponent = 3;
+
+  if(micros < 8)
+    return micros;
+  while(exponent < 62 && (micros >> (exponent + 1)) != 0)
+    exponent++;
+  if((exponent - 2) * 8 + 7 >= LATENCY_BUCKETS)
+    return LATENCY_BUCKETS - 1;
+  return (exponent - 2) * 8 + ((micros >> (exponent - 3)) & 7);
+}
+
+// Upper end of the bucket holding the given share of the requests, 0
+// before the first one
+uint64_t latencyPercentile(Latency *latency, double share)
+{
+  uint64_t rank = ceil(latency->count * share);
+  uint64_t seen = 0;
+  int bucket = 0;
+
+  if(latency->count == 0)
+    return 0;
+  for(bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++)
+    if((seen += latency->buckets[bucket]) >= rank && seen > 0)
+      break;
+  bucket++;
+  if(bucket < 8)
+    return bucket;
+  return ((uint64_t) 8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+char *latencyReport(Latency *latency)
+{
+  char *report = NULL;
+
+  pthread_mutex_lock(&latency->lock);
+  if(asprintf(&report, MSG_LATENCY, (unsigned long long) latency->count,
+      (unsigned long long) latency->failed, (unsigned long long)
+      latencyPercentile(latency, 0.5), (unsigned long long)
+      latencyPercentile(latency, 0.99)) < 0)
+    report = NULL;
+  pthread_mutex_unlock(&latency->lock);
+  return report;
+}
+
+int sendAll(int fd, const char *data, size_t size)
+{
+  ssize_t written = 0;
+
+  for(; size > 0; data += written, size -= written)
+    if((written = send(fd, data, size, MSG_NOSIGNAL)) <= 0)
+      return 3;
+  return 0;
+}
+
+int isStatsRequest(char *line)
+{
+  return strncmp(line, "stats", 5) == 0 && strspn(line + 5, " \t\r\n") ==
+      strlen(line + 5);
+}
+
+// Answers "stats" with the latency counters of the renders
+int serveStats(Server *server, int fd)
+{
+  char header[32];
+  char *report = NULL;
+  int status = 0;
+
+  if((report = latencyReport(&server->latency)) == NULL)
+    return 2;
+  snprintf(header, sizeof(header), "ok %zu\n", strlen(report));
+  status = sendAll(fd, header, strlen(header)) |
+      sendAll(fd, report, strlen(report));
+  free(report);
+  return status ? 3 : 0;
+}
+
+// Answers one job line as in a batch, whose output "-" comes back as
+// "ok size" and the encoded bytes. Failures are answered with their error
+// message.
+int serveRequest(Server *server, char *line, RenderContext *context, int fd)
+{
+  Parameter params = *server->defaults;
+  Options options = *server->options;
+  MemoryOutput memory;
+  CacheStats stats;
+  char header[32];
+  char *bmp_name = "-";
+  int status = 0;
+
+  memset(&memory, 0, sizeof(MemoryOutput));
+  if((status = parseJob(line, &params, &options, &bmp_name)) == 0)
+  {
+    if(strcmp(bmp_name, "-") == 0)
+      options.memory = &memory;
+    status = renderCached(bmp_name, &params, &options, context, &stats);
+  }
+  if(status == 0)
+  {
+    snprintf(header, sizeof(header), "ok %zu\n", memory.size);
+    if(sendAll(fd, header, strlen(header)) != 0 ||
+        sendAll(fd, memory.data, memory.size) != 0)
+      status = 3;
+  }
+  else
+    sendAll(fd, statusMessage(status), strlen(statusMessage(status)));
+  free(memory.data);
+  return status;
+}
+
+// Accepts clients and marks the idle connections with data as ready
+void *servePoller(void *arg)
+{
+  Server *server = (Server *) arg;
+  Connection **polled = NULL;
+  Connection **connections = NULL;
+  Connection *connection = NULL;
+  struct pollfd *fds = NULL;
+  char drain[64];
+  int count = 0;
+  int cur_fd = 0;
+  int client = 0;
+
+  while(1)
+  {
+    pthread_mutex_lock(&server->lock);
+    fds = (struct pollfd *) realloc(fds, sizeof(struct pollfd) *
+        (server->count + 2));
+    polled = (Connection **) realloc(polled, sizeof(Connection *) *
+        (server->count + 2));
+    if(fds == NULL || polled == NULL)
+    {
+      pthread_mutex_unlock(&server->lock);
+      break;
+    }
+    fds[0].fd = server->listen_fd;
+    fds[1].fd = server->wake_fds[0];
+    for(count = 2, cur_fd = 0; cur_fd < server->count; cur_fd++)
+      if(server->connections[cur_fd]->state == CONNECTION_IDLE)
+      {
+        polled[count] = server->connections[cur_fd];
+        fds[count++].fd = server->connections[cur_fd]->fd;
+      }
+    pthread_mutex_unlock(&server->lock);
+    for(cur_fd = 0; cur_fd < count; cur_fd++)
+      fds[cur_fd].events = POLLIN;
+    if(poll(fds, count, -1) < 0)
+      continue;
+
+    if(fds[1].revents)
+      while(read(server->wake_fds[0], drain, sizeof(drain)) > 0);
+    if((fds[0].revents & POLLIN) &&
+        (client = accept(server->listen_fd, NULL, NULL)) >= 0)
+    {
+      connection = (Connection *) calloc(1, sizeof(Connection));
+      pthread_mutex_lock(&server->lock);
+      if(connection != NULL && server->count == server->capacity &&
+          (connections = (Connection **) realloc(server->connections,
+          sizeof(Connection *) * (server->capacity ? 2 * server->capacity :
+          16))) != NULL)
+      {
+        server->connections = connections;
+        server->capacity = server->capacity ? 2 * server->capacity : 16;
+      }
+      if(connection != NULL && server->count < server->capacity)
+      {
+        connection->fd = client;
+        server->connections[server->count++] = connection;
+      }
+      else
+      {
+        close(client);
+        free(connection);
+      }
+      pthread_mutex_unlock(&server->lock);
+    }
+
+    // idle connections are only touched here, so polled is still valid
+    pthread_mutex_lock(&server->lock);
+    for(cur_fd = 2; cur_fd < count; cur_fd++)
+      if(fds[cur_fd].revents)
+      {
+        polled[cur_fd]->state = CONNECTION_READY;
+        polled[cur_fd]->ticket = server->tickets++;
+        pthread_cond_signal(&server->ready);
       }
-      if((points[1] = (int *) realloc(points[1], (cur_x + 10)*(sizeof(int))))
-          == NULL)
+    pthread_mutex_unlock(&server->lock);
+  }
+  free(fds);
+  free(polled);
+  return NULL;
+}
+
+// A full pipe already holds a wakeup, so only interrupted writes are retried
+void wakePoller(Server *server)
+{
+  while(write(server->wake_fds[1], "", 1) < 0 && errno == EINTR);
+}
+
+// Answers a request line and counts the renders
+void serveLine(Server *server, char *line, RenderContext *context, int fd)
+{
+  struct timespec start;
+  struct timespec end;
+  uint64_t micros = 0;
+  int status = 0;
+
+  line += strspn(line, " \t\r\n");
+  if(*line == '\0' || *line == '#')
+    return;
+  // only renders go into the latency counters
+  if(isStatsRequest(line))
+  {
+    serveStats(server, fd);
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  status = serveRequest(server, line, context, fd);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  micros = (end.tv_sec - start.tv_sec) * 1000000LL +
+      (end.tv_nsec - start.tv_nsec) / 1000;
+  pthread_mutex_lock(&server->latency.lock);
+  server->latency.buckets[latencyBucket(micros)]++;
+  server->latency.count++;
+  if(status != 0)
+    server->latency.failed++;
+  pthread_mutex_unlock(&server->latency.lock);
+}
+
+// Reads what the ready connection has sent and answers every complete
+// line. Returns 0 when the connection goes back to idle, or 1 when it is
+// closed: at its end, on errors or for a line beyond REQUEST_SIZE.
+int serveConnection(Server *server, Connection *connection,
+    RenderContext *context)
+{
+  char *buffer = NULL;
+  char *end = NULL;
+  size_t length = 0;
+  ssize_t received = 0;
+
+  // one byte stays free for the terminator of the last line
+  if(connection->size + 1 >= connection->capacity)
+  {
+    if(connection->capacity >= REQUEST_SIZE || (buffer = (char *) realloc(
+        connection->buffer, connection->capacity + 4096)) == NULL)
+      return 1;
+    connection->buffer = buffer;
+    connection->capacity += 4096;
+  }
+  // poll saw data, so this doesn't block
+  if((received = read(connection->fd, connection->buffer + connection->size,
+      connection->capacity - connection->size - 1)) < 0 && errno == EINTR)
+    return 0;
+  if(received <= 0)
+  {
+    // the last request may go without its newline
+    if(connection->size > 0)
+    {
+      connection->buffer[connection->size] = '\0';
+      serveLine(server, connection->buffer, context, connection->fd);
+    }
+    return 1;
+  }
+  connection->size += received;
+  while((end = (char *) memchr(connection->buffer, '\n', connection->size))
+      != NULL)
+  {
+    *end = '\0';
+    length = end + 1 - connection->buffer;
+    serveLine(server, connection->buffer, context, connection->fd);
+    memmove(connection->buffer, end + 1, connection->size - length);
+    connection->size -= length;
+  }
+  return 0;
+}
+
+void *serveWorker(void *arg)
+{
+  Server *server = (Server *) arg;
+  Connection *connection = NULL;
+  RenderContext context;
+  int cur_connection = 0;
+  int closed = 0;
+
+  memset(&context, 0, sizeof(RenderContext));
+  pthread_mutex_lock(&server->lock);
+  while(1)
+  {
+    // the connection that has been ready the longest goes first
+    connection = NULL;
+    for(cur_connection = 0; cur_connection < server->count; cur_connection++)
+      if(server->connections[cur_connection]->state == CONNECTION_READY &&
+          (connection == NULL || server->connections[cur_connection]->ticket
+          < connection->ticket))
+        connection = server->connections[cur_connection];
+    if(connection == NULL)
+    {
+      pthread_cond_wait(&server->ready, &server->lock);
+      continue;
+    }
+    connection->state = CONNECTION_BUSY;
+    pthread_mutex_unlock(&server->lock);
+
+    closed = serveConnection(server, connection, &context);
+
+    pthread_mutex_lock(&server->lock);
+    if(closed)
+    {
+      for(cur_connection = 0; server->connections[cur_connection] !=
+          connection; cur_connection++);
+      server->connections[cur_connection] =
+          server->connections[--server->count];
+      close(connection->fd);
+      free(connection->buffer);
+      free(connection);
+    }
+    else
+    {
+      connection->state = CONNECTION_IDLE;
+      wakePoller(server);
+    }
+  }
+  pthread_mutex_unlock(&server->lock);
+  freeRenderContext(&context);
+  return NULL;
+}
+
+// Binds the socket, replacing the file of a daemon that is gone but not one
+// that still accepts connections
+int listenSocket(char *path)
+{
+  struct sockaddr_un address;
+  int fd = 0;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(address.sun_path) ||
+      (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return -1;
+  strcpy(address.sun_path, path);
+  if(connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0)
+  {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  unlink(path);
+  // non-blocking, as a client may be gone between poll and accept
+  if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+    return -1;
+  if(bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+      listen(fd, SOMAXCONN) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Serves render requests until SIGINT or SIGTERM, then prints the latency
+// counters. The workers share the static layers of the common resolutions.
+int runServer(Options *options, Parameter *params)
+{
+  Server server;
+  LayerCache layers;
+  pthread_t *threads = NULL;
+  sigset_t signals;
+  char *report = NULL;
+  int started = 0;
+  int cur_thread = 0;
+  int signal_number = 0;
+
+  memset(&server, 0, sizeof(Server));
+  server.defaults = params;
+  server.options = options;
+  if((server.listen_fd = listenSocket(options->serve)) < 0)
+  {
+    printf(MSG_SOCKET);
+    return 3;
+  }
+  if(pipe2(server.wake_fds, O_NONBLOCK | O_CLOEXEC) != 0)
+  {
+    close(server.listen_fd);
+    unlink(options->serve);
+    printf(MSG_SOCKET);
+    return 3;
+  }
+  if((threads = (pthread_t *) malloc(sizeof(pthread_t) *
+      (options->workers + 1))) == NULL)
+  {
+    close(server.listen_fd);
+    unlink(options->serve);
+    printf(MSG_OOM);
+    return 2;
+  }
+  initLayerCache(&layers, options->layer_dir);
+  options->layers = &layers;
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.ready, NULL);
+  pthread_mutex_init(&server.latency.lock, NULL);
+
+  // the workers inherit the blocked signals, only this thread takes them
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  if(pthread_create(&threads[options->workers], NULL, servePoller,
+      &server) == 0)
+    for(cur_thread = 0; cur_thread < options->workers; cur_thread++)
+      if(pthread_create(&threads[cur_thread], NULL, serveWorker, &server) ==
+          0)
+        started++;
+  if(started)
+  {
+    printf(MSG_SERVE, options->serve, started);
+    fflush(stdout);
+    sigwait(&signals, &signal_number);
+  }
+  else
+    printf(MSG_OOM);
+
+  // requests in progress are cut off with the process
+  close(server.listen_fd);
+  unlink(options->serve);
+  if((report = latencyReport(&server.latency)) != NULL)
+    printf("%s", report);
+  free(report);
+  free(threads);
+  return started ? 0 : 2;
+}
+
+int runBatch(Options *options, Parameter *params)
+{
+  Batch batch;
+  LayerCache layers;
+  CacheStats stats;
+  pthread_t *threads = NULL;
+  int started = 0;
+  int cur_thread = 0;
+
+  memset(&batch, 0, sizeof(Batch));
+  batch.defaults = params;
+  batch.options = options;
+  if(strcmp(options->batch_name, "-") == 0)
+    batch.job_file = stdin;
+  else if((batch.job_file = fopen(options->batch_name, "r")) == NULL)
+  {
+    printf(MSG_JOBFILE);
+    return 1;
+  }
+  if((threads = (pthread_t *) malloc(sizeof(pthread_t) * options->workers))
+      == NULL)
+  {
+    printf(MSG_OOM);
+    return 2;
+  }
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_mutex_init(&batch.output_lock, NULL);
+  // jobs at the same resolution and angle share their background and cannon
+  initLayerCache(&layers, options->layer_dir);
+  options->layers = &layers;
+  for(cur_thread = 0; cur_thread < options->workers; cur_thread++)
+    if(pthread_create(&threads[cur_thread], NULL, batchWorker, &batch) == 0)
+      started++;
+  // without any thread the jobs still get done, just serially
+  if(!started)
+    batchWorker(&batch);
+  for(cur_thread = 0; cur_thread < started; cur_thread++)
+    pthread_join(threads[cur_thread], NULL);
+  pthread_mutex_destroy(&batch.lock);
+  pthread_mutex_destroy(&batch.output_lock);
+  options->layers = NULL;
+  freeLayerCache(&layers);
+  free(threads);
+  if(batch.job_file != stdin)
+    fclose(batch.job_file);
+  printf(MSG_JOBS, batch.jobs, batch.failed);
+  if(options->cache_dir && options->stats && updateCache(options, -1, 0, 1,
+      &stats) == 0)
+    printCacheStats(&stats);
+  return batch.failed ? 5 : 0;
+}
+
+// Parses angle speed {RRGGBB}, shots without a color take the next one of
+// a fixed set that starts with the red of a single shot
+int parseShot(char *line, int number, Shot *shot)
+{
+  static const int colors[] = {0xFF0000, 0x0000FF, 0xFFFF00, 0xFF00FF,
+      0x00A000, 0xFF8000, 0x8000FF, 0x00FFFF, 0x800000, 0x000080,
+      0xFFFFFF, 0x000000};
+  char *save = NULL;
+  char *token = NULL;
+  char *end = NULL;
+  long color = 0;
+
+  if((token = strtok_r(line, " \t\r\n", &save)) == NULL)
+    return 1;
+  shot->params.v_angle = strtof(token, &end);
+  if(*end != '\0' || (token = strtok_r(NULL, " \t\r\n", &save)) == NULL)
+    return 1;
+  shot->params.v_speed = strtof(token, &end);
+  if(*end != '\0')
+    return 1;
+  shot->color = colors[number % (sizeof(colors) / sizeof(colors[0]))];
+  if((token = strtok_r(NULL, " \t\r\n", &save)) == NULL)
+    return 0;
+  color = strtol(token + (*token == '#'), &end, 16);
+  if(*end != '\0' || end == token || color < 0 || color > 0xFFFFFF ||
+      strtok_r(NULL, " \t\r\n", &save) != NULL)
+    return 1;
+  shot->color = color;
+  return 0;
+}
+
+void freeOverlay(Overlay *overlay)
+{
+  int cur_shot = 0;
+
+  for(cur_shot = 0; cur_shot < overlay->count; cur_shot++)
+  {
+    free(overlay->shots[cur_shot].points[0]);
+    free(overlay->shots[cur_shot].points[1]);
+  }
+  free(overlay->shots);
+  overlay->shots = NULL;
+  overlay->count = 0;
+  overlay->capacity = 0;
+}
+
+// Reads the shots of the file, each with the config values of params
+int readOverlay(char *file_name, Parameter *params, Overlay *overlay)
+{
+  FILE *shot_file = NULL;
+  Shot *shots = NULL;
+  char *line = NULL;
+  char *first = NULL;
+  size_t line_size = 0;
+  int line_number = 0;
+  int status = 0;
+
+  if(strcmp(file_name, "-") == 0)
+    shot_file = stdin;
+  else if((shot_file = fopen(file_name, "r")) == NULL)
+  {
+    printf(MSG_SHOTFILE);
+    return 1;
+  }
+  while(!status && getline(&line, &line_size, shot_file) >= 0)
+  {
+    line_number++;
+    first = line + strspn(line, " \t\r\n");
+    if(*first == '\0' || *first == '#')
+      continue;
+    if(overlay->count == overlay->capacity)
+    {
+      if((shots = (Shot *) realloc(overlay->shots, sizeof(Shot) *
+          (overlay->capacity + SCENE_CHUNK))) == NULL)
       {
         printf(MSG_OOM);
-        return 2;
+        status = 2;
+        break;
       }
+      overlay->shots = shots;
+      overlay->capacity += SCENE_CHUNK;
+    }
+    memset(&overlay->shots[overlay->count], 0, sizeof(Shot));
+    overlay->shots[overlay->count].params = *params;
+    if(parseShot(line, overlay->count, &overlay->shots[overlay->count]) != 0)
+    {
+      printf(MSG_SHOT, line_number);
+      status = 1;
     }
-    t = p * cur_x;
-    points[0][cur_x] = points[0][0] + v_x * t + w_x * t*t / 2 + 0.5;
-    points[1][cur_x] = points[1][0] + v_y * t + g * t*t / 2 + w_y*t*t/ 2 + 0.5;
-    cur_x++;
+    else
+      overlay->count++;
+  }
+  free(line);
+  if(shot_file != stdin)
+    fclose(shot_file);
+  if(!status && overlay->count == 0)
+  {
+    printf(MSG_SHOTFILE);
+    status = 1;
+  }
+  return status;
+}
+
+// Samples of one shot, or just its curve or cursor when drawn from those
+int simulateShot(Shot *shot, int draw)
+{
+  Parameter *params = &shot->params;
+
+  if(params->v_speed <= 0)
+    return 4;
+  if(draw == DRAW_PARABOLA)
+  {
+    setCurve(params, &shot->curve);
+    return 0;
+  }
+  if((shot->count = sampleCount(params)) < 0)
+    return 9;
+  if(draw == DRAW_FUSED)
+  {
+    startFlight(params, shot->count, &shot->flight);
+    return 0;
+  }
+  if((shot->points[0] = (int *) malloc(sizeof(int) * shot->count)) == NULL ||
+      (shot->points[1] = (int *) malloc(sizeof(int) * shot->count)) == NULL)
+    return 2;
+  shot->points[0][0] = params->width / 2;
+  shot->points[1][0] = params->height / 2;
+  return calculation(shot->points, &shot->count, params);
+}
+
+void *overlayWorker(void *arg)
+{
+  Overlay *overlay = (Overlay *) arg;
+  int cur_shot = 0;
+
+  while(1)
+  {
+    pthread_mutex_lock(&overlay->lock);
+    cur_shot = overlay->next++;
+    pthread_mutex_unlock(&overlay->lock);
+    if(cur_shot >= overlay->count)
+      break;
+    overlay->shots[cur_shot].status = simulateShot(&overlay->shots[cur_shot],
+        overlay->draw);
   }
+  return NULL;
+}
+
+// Simulates the shots with up to workers threads, every shot writes only
+// its own samples
+int simulateOverlay(Overlay *overlay, int workers)
+{
+  pthread_t *threads = NULL;
+  int started = 0;
+  int cur_thread = 0;
+  int cur_shot = 0;
 
-  while(points[0][cur_x-2] < params->width && points[0][cur_x-2] > 0 &&
-        points[1][cur_x-2] > 0 && points[1][cur_x-2] < params->height);
-  *counter = cur_x;
+  overlay->next = 0;
+  if(workers > overlay->count)
+    workers = overlay->count;
+  pthread_mutex_init(&overlay->lock, NULL);
+  // without the thread array the calling thread simulates all shots
+  if(workers > 1 && (threads = (pthread_t *) malloc(sizeof(pthread_t) *
+      (workers - 1))) != NULL)
+    for(cur_thread = 1; cur_thread < workers; cur_thread++)
+      if(pthread_create(&threads[started], NULL, overlayWorker, overlay) == 0)
+        started++;
+  overlayWorker(overlay);
+  for(cur_thread = 0; cur_thread < started; cur_thread++)
+    pthread_join(threads[cur_thread], NULL);
+  free(threads);
+  pthread_mutex_destroy(&overlay->lock);
+  for(cur_shot = 0; cur_shot < overlay->count; cur_shot++)
+    if(overlay->shots[cur_shot].status != 0)
+      return overlay->shots[cur_shot].status;
   return 0;
 }
 
-Parameter* setStandard(Parameter *params, float angle, float speed)
+// Background and the cannon aimed like the first shot once, then every shot
+// in file order. A color that finds the palette full is an error.
+int buildOverlay(Overlay *overlay, int composite, Scene *scene)
 {
+  Shot *shot = NULL;
+  int cur_shot = 0;
+  int status = 0;
 
-  params->height = 320;
-  params->width = 320;
-  params->pps = 5;
-  params->gravitation = 9.798;
-  params->wind_angle = 0;
-  params->wind_force = 0;
-  params->v_angle = angle;
-  params->v_speed = speed;
-  return params;
+  resetScene(scene);
+  if(!composite)
+  {
+    status |= addPrimitive(scene, PRIM_BACKGROUND, 0x60D0FF, 0, NULL, 0);
+    status |= drawCannon(&overlay->shots[0].params, scene);
+    scene->layer_count = scene->count;
+    scene->layer_colors = scene->palette.count;
+  }
+  for(cur_shot = 0; cur_shot < overlay->count && !status; cur_shot++)
+  {
+    shot = &overlay->shots[cur_shot];
+    status |= addPath(shot->points, shot->count,
+        (overlay->draw == DRAW_PARABOLA) ? &shot->curve : NULL,
+        (overlay->draw == DRAW_FUSED) ? &shot->flight : NULL, shot->color,
+        scene);
+  }
+  return status;
 }
 
-int main(int argc, char *argv[])
+// Draws all shots of the overlay into one image. The shots are simulated
+// in parallel, then drawn in bands of rows by options->threads threads.
+int renderOverlay(char *bmp_name, Parameter *params, Options *options,
+    RenderContext *context, Overlay *overlay)
+{
+  Parameter aimed;
+  int cur_shot = 0;
+  int status = 0;
+
+  if(options->composite && (status = readBitMapSize(bmp_name, params)) != 0)
+    return status;
+  if(params->width == 0 || params->height == 0 || params->pps == 0)
+    return 1;
+  for(cur_shot = 0; cur_shot < overlay->count; cur_shot++)
+  {
+    overlay->shots[cur_shot].params.width = params->width;
+    overlay->shots[cur_shot].params.height = params->height;
+  }
+  overlay->draw = options->draw;
+  if((status = simulateOverlay(overlay, options->workers)) != 0 ||
+      (status = buildOverlay(overlay, options->composite,
+      &context->scene)) != 0)
+    return status;
+  context->point_count = 0;
+  for(cur_shot = 0; cur_shot < overlay->count; cur_shot++)
+    context->point_count += overlay->shots[cur_shot].count;
+  // the cannon, and with it the cached layer, is aimed like the first shot
+  aimed = *params;
+  aimed.v_angle = overlay->shots[0].params.v_angle;
+  return renderScene(bmp_name, &aimed, options, context);
+}
+
+// Range, apex, time of flight and exit of a shot in closed form, from
+// the start to where it leaves the bitmap
+SweepRecord *flightMetrics(Parameter *params, SweepRecord *record)
+{
+  Motion motion;
+  int side = 0;
+  double start_x = params->width / 2;
+  double start_y = params->height / 2;
+  double t_exit = exitBorder(params, setMotion(params, &motion), &side);
+  double a_y = motion.g + motion.w_y;
+  double t_top = 0;
+  double y_exit = start_y + motion.v_y * t_exit + a_y * t_exit * t_exit / 2;
+  double apex = (y_exit > start_y) ? y_exit - start_y : 0;
+
+  if(a_y != 0 && (t_top = -motion.v_y / a_y) > 0 && t_top < t_exit &&
+      motion.v_y * t_top + a_y * t_top * t_top / 2 > apex)
+    apex = motion.v_y * t_top + a_y * t_top * t_top / 2;
+  record->angle = params->v_angle;
+  record->speed = params->v_speed;
+  record->wind_angle = params->wind_angle;
+  record->wind_force = params->wind_force;
+  record->gravitation = params->gravitation;
+  record->impact_x = start_x + motion.v_x * t_exit +
+      motion.w_x * t_exit * t_exit / 2;
+  record->impact_y = y_exit;
+  // 1 pixel = 10 meters
+  record->range = fabs(record->impact_x - start_x) * 10;
+  record->apex = apex * 10;
+  record->flight_time = t_exit;
+  record->exit_side = side;
+  return record;
+}
+
+// Parses name=from:to:step or name=value for each field to sweep, fields
+// left out keep the value of the config
+int parseSweep(char *spec, Parameter *params, Sweep *sweep)
+{
+  static const char *names[SWEEP_FIELDS] = {"angle", "speed", "wind_angle",
+      "wind_force", "gravitation"};
+  float defaults[SWEEP_FIELDS] = {params->v_angle, params->v_speed,
+      params->wind_angle, params->wind_force, params->gravitation};
+  char *save = NULL;
+  char *token = NULL;
+  char *value = NULL;
+  char *end = NULL;
+  float to = 0;
+  int cur_field = 0;
+
+  for(cur_field = 0; cur_field < SWEEP_FIELDS; cur_field++)
+  {
+    sweep->ranges[cur_field].from = defaults[cur_field];
+    sweep->ranges[cur_field].step = 0;
+    sweep->ranges[cur_field].count = 1;
+  }
+  for(token = strtok_r(spec, ",", &save); token != NULL;
+      token = strtok_r(NULL, ",", &save))
+  {
+    if((value = strchr(token, '=')) == NULL)
+      return 1;
+    *value++ = '\0';
+    for(cur_field = 0; cur_field < SWEEP_FIELDS &&
+        strcmp(token, names[cur_field]) != 0; cur_field++)
+      ;
+    if(cur_field == SWEEP_FIELDS)
+      return 1;
+    sweep->ranges[cur_field].from = strtof(value, &end);
+    if(end == value)
+      return 1;
+    if(*end == '\0')
+      continue;
+    if(*end != ':' || (to = strtof(value = end + 1, &end), end == value) ||
+        *end != ':' || (sweep->ranges[cur_field].step = strtof(value =
+        end + 1, &end), end == value) || *end != '\0' ||
+        !(sweep->ranges[cur_field].step > 0) ||
+        to < sweep->ranges[cur_field].from ||
+        !((to - sweep->ranges[cur_field].from) /
+        sweep->ranges[cur_field].step < INT32_MAX - 1))
+      return 1;
+    // the small allowance keeps to in the range despite float steps
+    sweep->ranges[cur_field].count = (to - sweep->ranges[cur_field].from) /
+        sweep->ranges[cur_field].step + 1e-4 + 1;
+  }
+  // half the range leaves room for the chunks the workers take past the end
+  sweep->cells = 1;
+  for(cur_field = 0; cur_field < SWEEP_FIELDS; cur_field++)
+  {
+    if(sweep->cells > UINT64_MAX / 2 / sweep->ranges[cur_field].count)
+      return 1;
+    sweep->cells *= sweep->ranges[cur_field].count;
+  }
+  return 0;
+}
+
+int writeSweepRecord(SweepRecord *record, int format, ByteBuffer *buffer)
+{
+  static const char *sides[] = {"none", "left", "right", "bottom", "top"};
+  uint8_t *out = NULL;
+  int length = 0;
+
+  if((out = reserveBytes(buffer, 256)) == NULL)
+    return 2;
+  if(format == RECORD_BINARY)
+  {
+    memcpy(out, record, sizeof(SweepRecord));
+    buffer->size += sizeof(SweepRecord);
+    return 0;
+  }
+  length = snprintf((char *) out, 256, "%g,%g,%g,%g,%g,%.6g,%.6g,%.6g,%.6g,"
+      "%.6g,%s\n", record->angle, record->speed, record->wind_angle,
+      record->wind_force, record->gravitation, record->range, record->apex,
+      record->flight_time, record->impact_x, record->impact_y,
+      sides[record->exit_side]);
+  buffer->size += (length < 256) ? length : 255;
+  return 0;
+}
+
+void *sweepWorker(void *arg)
+{
+  Sweep *sweep = (Sweep *) arg;
+  SweepRange *range = NULL;
+  SweepRecord record;
+  ByteBuffer buffer;
+  Parameter params = *sweep->defaults;
+  float *fields[SWEEP_FIELDS] = {&params.v_angle, &params.v_speed,
+      &params.wind_angle, &params.wind_force, &params.gravitation};
+  uint64_t chunk = 0;
+  uint64_t cell = 0;
+  uint64_t last = 0;
+  uint64_t rest = 0;
+  int cur_field = 0;
+  int status = 0;
+
+  memset(&buffer, 0, sizeof(ByteBuffer));
+  while(1)
+  {
+    pthread_mutex_lock(&sweep->lock);
+    chunk = sweep->next_chunk++;
+    pthread_mutex_unlock(&sweep->lock);
+    if(chunk * SWEEP_CHUNK >= sweep->cells)
+      break;
+
+    // the last field changes fastest
+    buffer.size = 0;
+    last = (chunk + 1) * SWEEP_CHUNK;
+    for(cell = chunk * SWEEP_CHUNK; cell < last && cell < sweep->cells;
+        cell++)
+    {
+      for(rest = cell, cur_field = SWEEP_FIELDS - 1; cur_field >= 0;
+          cur_field--)
+      {
+        range = &sweep->ranges[cur_field];
+        *fields[cur_field] = range->from + range->step *
+            (float) (rest % range->count);
+        rest /= range->count;
+      }
+      status |= writeSweepRecord(flightMetrics(&params, &record),
+          sweep->record, &buffer);
+    }
+
+    pthread_mutex_lock(&sweep->lock);
+    while(sweep->written_chunk != chunk)
+      pthread_cond_wait(&sweep->written, &sweep->lock);
+    fwrite(buffer.data, 1, buffer.size, sweep->fp);
+    sweep->written_chunk++;
+    pthread_cond_broadcast(&sweep->written);
+    pthread_mutex_unlock(&sweep->lock);
+  }
+  free(buffer.data);
+  return status ? (void *) sweep : NULL;
+}
+
+int runSweep(char *file_name, Options *options, Parameter *params)
 {
+  Sweep sweep;
+  pthread_t *threads = NULL;
+  void *result = NULL;
+  int started = 0;
+  int cur_thread = 0;
+  int status = 0;
 
-  if((argc < 4)|(argc > 5))
+  memset(&sweep, 0, sizeof(Sweep));
+  sweep.defaults = params;
+  sweep.record = options->record;
+  if(parseSweep(options->sweep, params, &sweep) != 0)
   {
     printf(MSG_PARAMETER);
     return 1;
   }
-  Parameter *params;
-  if((params = (Parameter*) calloc(1, sizeof(Parameter))) == NULL)
+  if((threads = (pthread_t *) malloc(sizeof(pthread_t) * options->workers))
+      == NULL)
   {
     printf(MSG_OOM);
     return 2;
   }
-  setStandard(params, strtof(argv[1],NULL), strtof(argv[2],NULL));
-  if(argc == 5)
+  if((sweep.fp = openOutput(file_name, options)) == NULL)
+  {
+    free(threads);
+    printf(MSG_WRITE);
+    return 3;
+  }
+  if(sweep.record == RECORD_CSV)
+    fprintf(sweep.fp, MSG_SWEEP_HEADER);
+  pthread_mutex_init(&sweep.lock, NULL);
+  pthread_cond_init(&sweep.written, NULL);
+  for(cur_thread = 0; cur_thread < options->workers; cur_thread++)
+    if(pthread_create(&threads[cur_thread], NULL, sweepWorker, &sweep) == 0)
+      started++;
+  if(!started && sweepWorker(&sweep) != NULL)
+    status = 2;
+  for(cur_thread = 0; cur_thread < started; cur_thread++)
   {
-    readConfig(argv[4], params);
+    pthread_join(threads[cur_thread], &result);
+    if(result != NULL)
+      status = 2;
   }
+  pthread_cond_destroy(&sweep.written);
+  pthread_mutex_destroy(&sweep.lock);
+  free(threads);
+  if((ferror(sweep.fp) | (fclose(sweep.fp) != 0)) && !status)
+    status = 3;
+  if(status)
+    printf("%s", statusMessage(status));
   else
+    printf(MSG_SWEEP, (unsigned long long) sweep.cells);
+  return status;
+}
+
+// Angle of the start velocity D/t - a t/2 that is at D after t seconds
+double aimAngle(double d_x, double d_y, double a_x, double a_y, double t)
+{
+  return atan2(d_y / t - a_y * t / 2, d_x / t - a_x * t / 2) * 57.2957795;
+}
+
+// Leaves out the solution at angle and speed (m/s) if its shot leaves the
+// bitmap before it reaches the target after t, the renderer never draws it
+void dropExited(Parameter *params, double speed, double *angle, double *t)
+{
+  Parameter shot = *params;
+  Motion motion;
+
+  if(isnan(*t))
+    return;
+  shot.v_angle = *angle;
+  shot.v_speed = speed;
+  if(exitTime(&shot, setMotion(&shot, &motion)) < *t)
+    *angle = *t = NAN;
+}
+
+// Hitting D = target - start after t means |D/t - a t/2| = speed, which
+// for u = t^2 is |a|^2/4 u^2 - (D.a + speed^2) u + |D|^2 = 0. Its two
+// roots are the low and the high shot, they meet at the minimum speed
+// speed^2 = |a||D| - D.a.
+Solution *solveTarget(Parameter *params, double x, double y, double speed,
+    Solution *solution)
+{
+  Motion motion;
+  double a_x = 0;
+  double a_y = 0;
+  double d_x = x - params->width / 2;
+  double d_y = y - params->height / 2;
+  double aa = 0;
+  double dd = d_x * d_x + d_y * d_y;
+  double b = 0;
+  double root = 0;
+  double t = 0;
+
+  setMotion(params, &motion);
+  a_x = motion.w_x;
+  a_y = motion.g + motion.w_y;
+  aa = a_x * a_x + a_y * a_y;
+  solution->x = x;
+  solution->y = y;
+  solution->speed = speed;
+  solution->low_angle = solution->low_time = NAN;
+  solution->high_angle = solution->high_time = NAN;
+  solution->min_speed = solution->min_angle = solution->min_time = NAN;
+
+  // speed in pixels per second, 1 pixel = 10 meters
+  speed /= 10;
+  if(dd == 0)
+    return solution;
+  if(aa == 0)
   {
-    printf(MSG_CONFIG);
+    // without acceleration every speed flies straight at the target
+    solution->min_speed = 0;
+    solution->min_angle = atan2(d_y, d_x) * 57.2957795;
+    if(speed > 0)
+    {
+      solution->low_angle = solution->high_angle = solution->min_angle;
+      solution->low_time = solution->high_time = sqrt(dd) / speed;
+      dropExited(params, solution->speed, &solution->low_angle,
+          &solution->low_time);
+      solution->high_angle = solution->low_angle;
+      solution->high_time = solution->low_time;
+    }
+    return solution;
   }
-  char *bmp_name = argv[3];
-  int **points;
 
+  t = sqrt(2 * sqrt(dd / aa));
+  solution->min_speed = sqrt(fmax(sqrt(aa * dd) - (d_x * a_x + d_y * a_y),
+      0)) * 10;
+  solution->min_angle = aimAngle(d_x, d_y, a_x, a_y, t);
+  solution->min_time = t;
+  dropExited(params, solution->min_speed, &solution->min_angle,
+      &solution->min_time);
+  if(isnan(solution->min_time))
+    solution->min_speed = NAN;
 
-  if(params->v_speed <= 0)
+  b = d_x * a_x + d_y * a_y + speed * speed;
+  if(speed <= 0 || b <= 0 || b * b < aa * dd)
+    return solution;
+  root = b + sqrt(b * b - aa * dd);
+  // the smaller root as 2|D|^2 / root keeps its precision
+  solution->low_time = sqrt(2 * dd / root);
+  solution->high_time = sqrt(2 * root / aa);
+  solution->low_angle = aimAngle(d_x, d_y, a_x, a_y, solution->low_time);
+  solution->high_angle = aimAngle(d_x, d_y, a_x, a_y, solution->high_time);
+  dropExited(params, solution->speed, &solution->low_angle,
+      &solution->low_time);
+  dropExited(params, solution->speed, &solution->high_angle,
+      &solution->high_time);
+  return solution;
+}
+
+void writeSolution(Solution *solution, FILE *fp)
+{
+  fprintf(fp, "%g,%g,%g,%.6g,%.6g,%.6g,%.6g,%.6g,%.6g,%.6g\n", solution->x,
+      solution->y, solution->speed, solution->low_angle, solution->low_time,
+      solution->high_angle, solution->high_time, solution->min_speed,
+      solution->min_angle, solution->min_time);
+}
+
+// Parses x y {speed}, separated by blanks or commas
+int parseTarget(char *line, double *x, double *y, double *speed)
+{
+  char *save = NULL;
+  char *token = NULL;
+  char *end = NULL;
+  double *values[3] = {x, y, speed};
+  int count = 0;
+
+  *speed = 0;
+  for(token = strtok_r(line, " ,\t\r\n", &save); token != NULL;
+      token = strtok_r(NULL, " ,\t\r\n", &save))
   {
-  printf(MSG_SPEED);
-  return 4;
+    if(count == 3)
+      return 1;
+    *values[count++] = strtod(token, &end);
+    if(*end != '\0')
+      return 1;
   }
+  return count < 2;
+}
+
+// Solves the target of the --solve option or every line of the target file,
+// one CSV line each
+int runSolve(Options *options, Parameter *params)
+{
+  Solution solution;
+  FILE *target_file = NULL;
+  FILE *fp = NULL;
+  char *line = NULL;
+  char *first = NULL;
+  size_t line_size = 0;
+  int line_number = 0;
+  int failed = 0;
+  double x = 0;
+  double y = 0;
+  double speed = 0;
 
-  if((points = (int **) malloc(sizeof(int) * 20)) == NULL)
+  if(options->solve && parseTarget(options->solve, &x, &y, &speed) != 0)
   {
-    printf(MSG_OOM);
-    return 2;
+    printf(MSG_PARAMETER);
+    return 1;
   }
-  if((points[0] = (int *)realloc(NULL, sizeof(int)*10)) == NULL)
+  if(options->solve_batch && strcmp(options->solve_batch, "-") == 0)
+    target_file = stdin;
+  else if(options->solve_batch &&
+      (target_file = fopen(options->solve_batch, "r")) == NULL)
   {
-    printf(MSG_OOM);
-    return 2;
+    printf(MSG_JOBFILE);
+    return 1;
   }
-  if((points[1] = (int *)realloc(NULL, sizeof(int)*10)) == NULL)
+  if((fp = openOutput("-", options)) == NULL)
   {
-    printf(MSG_OOM);
-    return 2;
+    printf(MSG_WRITE);
+    return 3;
   }
-  points[0][0] = params->width / 2;
-  points[1][0] = params->height / 2;
-  int counter = 0;
-  if(calculation(points, &counter, params) == 2)
-    return 2;
 
-  int drawreturn = 0;
-  if((drawreturn = drawBitMap(bmp_name, points, &counter, params)) == 3)
+  fprintf(fp, MSG_SOLVE_HEADER);
+  if(options->solve)
+    writeSolution(solveTarget(params, x, y, speed, &solution), fp);
+  while(target_file && getline(&line, &line_size, target_file) >= 0)
+  {
+    line_number++;
+    first = line + strspn(line, " \t\r\n");
+    if(*first == '\0' || *first == '#')
+      continue;
+    if(parseTarget(line, &x, &y, &speed) != 0)
+    {
+      printf(MSG_JOB_STATUS, line_number, "-", MSG_JOB);
+      failed++;
+      continue;
+    }
+    writeSolution(solveTarget(params, x, y, speed, &solution), fp);
+  }
+  free(line);
+  if(target_file && target_file != stdin)
+    fclose(target_file);
+  if(ferror(fp) | (fclose(fp) != 0))
+  {
+    printf(MSG_WRITE);
     return 3;
-  else if(drawreturn == 2)
-    return 2;
-  free(points);
+  }
+  return failed ? 5 : 0;
+}
+
+int parseOptions(int argc, char *argv[], Options *options)
+{
+  int cur_arg = 1;
+  long count = 0;
+
+  memset(options, 0, sizeof(Options));
+  if((count = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+    count = 1;
+  options->workers = count;
+  options->threads = 1;
+  options->level = 1;
+  options->cache_size = (uint64_t) CACHE_SIZE << 20;
+  options->shm_slots = SHM_SLOTS;
+  options->output_fd = STDOUT_FILENO;
+
+  while(cur_arg < argc && strncmp(argv[cur_arg], "--", 2) == 0)
+  {
+    if(strcmp(argv[cur_arg], "--stats") == 0)
+    {
+      options->stats = 1;
+      cur_arg++;
+      continue;
+    }
+    if(strcmp(argv[cur_arg], "--mmap") == 0)
+    {
+      options->map = 1;
+      cur_arg++;
+      continue;
+    }
+    if(strcmp(argv[cur_arg], "--composite") == 0)
+    {
+      options->composite = 1;
+      cur_arg++;
+      continue;
+    }
+    if(cur_arg + 1 >= argc)
+      return -1;
+    if(strcmp(argv[cur_arg], "--batch") == 0)
+      options->batch_name = argv[cur_arg + 1];
+    else if(strcmp(argv[cur_arg], "--sweep") == 0)
+      options->sweep = argv[cur_arg + 1];
+    else if(strcmp(argv[cur_arg], "--overlay") == 0)
+      options->overlay = argv[cur_arg + 1];
+    else if(strcmp(argv[cur_arg], "--solve") == 0)
+      options->solve = argv[cur_arg + 1];
+    else if(strcmp(argv[cur_arg], "--solve-batch") == 0)
+      options->solve_batch = argv[cur_arg + 1];
+    else if(strcmp(argv[cur_arg], "--record") == 0)
+    {
+      if(strcmp(argv[cur_arg + 1], "csv") == 0)
+        options->record = RECORD_CSV;
+      else if(strcmp(argv[cur_arg + 1], "binary") == 0)
+        options->record = RECORD_BINARY;
+      else
+        return -1;
+    }
+    else if(strcmp(argv[cur_arg], "--workers") == 0)
+    {
+      if((options->workers = atoi(argv[cur_arg + 1])) < 1)
+        return -1;
+    }
+    else if(strcmp(argv[cur_arg], "--threads") == 0)
+    {
+      if((options->threads = atoi(argv[cur_arg + 1])) < 1)
+        return -1;
+    }
+    else if(strcmp(argv[cur_arg], "--draw") == 0)
+    {
+      if(strcmp(argv[cur_arg + 1], "polyline") == 0)
+        options->draw = DRAW_POLYLINE;
+      else if(strcmp(argv[cur_arg + 1], "parabola") == 0)
+        options->draw = DRAW_PARABOLA;
+      else if(strcmp(argv[cur_arg + 1], "fused") == 0)
+        options->draw = DRAW_FUSED;
+      else
+        return -1;
+    }
+    else if(strcmp(argv[cur_arg], "--animate") == 0)
+    {
+      if(strcmp(argv[cur_arg + 1], "y4m") == 0)
+        options->animate = ANIMATE_Y4M;
+      else if(strcmp(argv[cur_arg + 1], "ppm") == 0)
+        options->animate = ANIMATE_PPM;
+      else if(strcmp(argv[cur_arg + 1], "bmp") == 0)
+        options->animate = ANIMATE_BMP;
+      else
+        return -1;
+    }
+    else if(strcmp(argv[cur_arg], "--serve") == 0)
+      options->serve = argv[cur_arg + 1];
+    else if(strcmp(argv[cur_arg], "--cache") == 0)
+      options->cache_dir = argv[cur_arg + 1];
+    else if(strcmp(argv[cur_arg], "--cache-size") == 0)
+    {
+      if((options->cache_size = strtoull(argv[cur_arg + 1], NULL, 10)) < 1)
+        return -1;
+      options->cache_size <<= 20;
+    }
+    else if(strcmp(argv[cur_arg], "--shm") == 0)
+      options->shm_name = argv[cur_arg + 1];
+    else if(strcmp(argv[cur_arg], "--shm-slots") == 0)
+    {
+      if((options->shm_slots = atoi(argv[cur_arg + 1])) < 1)
+        return -1;
+    }
+    else if(strcmp(argv[cur_arg], "--shm-slot") == 0)
+    {
+      if((options->shm_slot_size = strtoull(argv[cur_arg + 1], NULL, 10)) < 1)
+        return -1;
+      options->shm_slot_size <<= 20;
+    }
+    else if(strcmp(argv[cur_arg], "--layers") == 0)
+      options->layer_dir = argv[cur_arg + 1];
+    else if(strcmp(argv[cur_arg], "--format") == 0)
+    {
+      if((options->format = parseFormat(argv[cur_arg + 1])) < 0)
+        return -1;
+    }
+    else if(strcmp(argv[cur_arg], "--level") == 0)
+    {
+      options->level = atoi(argv[cur_arg + 1]);
+      if(options->level < 0 || options->level > 9)
+        return -1;
+    }
+    else if(strcmp(argv[cur_arg], "--band") == 0)
+    {
+      if((options->band_rows = atoi(argv[cur_arg + 1])) < 1)
+        return -1;
+    }
+    else
+      return -1;
+    cur_arg += 2;
+  }
+  return cur_arg;
+}
+
+void printStats(RenderContext *context)
+{
+  printf(MSG_SAMPLES, context->point_count);
+  printf(MSG_STATS, (unsigned long long) context->line_stats.filled_pixels,
+      (unsigned long long) context->line_stats.brush_pixels,
+      context->line_stats.filled_pixels ?
+      (double) context->line_stats.brush_pixels /
+      context->line_stats.filled_pixels : 0);
+}
 
+// Moves the messages to stderr when the output goes to stdout
+int redirectMessages(char *file_name, Options *options)
+{
+  if(strcmp(file_name, "-") != 0)
+    return 0;
+  fflush(stdout);
+  if((options->output_fd = dup(STDOUT_FILENO)) < 0 ||
+      dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+  {
+    printf(MSG_WRITE);
+    return 3;
+  }
   return 0;
 }
+
+int main(int argc, char *argv[])
+{
+  Options options;
+  Parameter params;
+  RenderContext context;
+  Overlay overlay;
+  LayerCache layers;
+  CacheStats stats;
+  ShmRing ring;
+  int first_arg = 0;
+  int status = 0;
+
+  if((first_arg = parseOptions(argc, argv, &options)) < 0)
+  {
+    printf(MSG_PARAMETER);
+    return 1;
+  }
+
+  if(options.batch_name)
+  {
+    if(argc - first_arg > 1)
+    {
+      printf(MSG_PARAMETER);
+      return 1;
+    }
+    // any job may write its image to stdout
+    if(redirectMessages("-", &options) != 0)
+      return 3;
+    setStandard(&params, 0, 0);
+    if(argc - first_arg == 1)
+      readConfig(argv[first_arg], &params);
+    else
+      printf(MSG_CONFIG);
+    if(options.shm_name && (status = openRing(&options, &params, &ring)) != 0)
+    {
+      printf((status == 1) ? MSG_SHM_EXISTS : MSG_SHM);
+      return 3;
+    }
+    status = runBatch(&options, &params);
+    if(options.ring)
+      closeRing(&ring, &params);
+    return status;
+  }
+
+  if(options.sweep)
+  {
+    if((argc - first_arg < 1) | (argc - first_arg > 2))
+    {
+      printf(MSG_PARAMETER);
+      return 1;
+    }
+    if(redirectMessages(argv[first_arg], &options) != 0)
+      return 3;
+    setStandard(&params, 0, 0);
+    if(argc - first_arg == 2)
+      readConfig(argv[first_arg + 1], &params);
+    else
+      printf(MSG_CONFIG);
+    return runSweep(argv[first_arg], &options, &params);
+  }
+
+  if(options.solve || options.solve_batch)
+  {
+    if(argc - first_arg > 1)
+    {
+      printf(MSG_PARAMETER);
+      return 1;
+    }
+    if(redirectMessages("-", &options) != 0)
+      return 3;
+    setStandard(&params, 0, 0);
+    if(argc - first_arg == 1)
+      readConfig(argv[first_arg], &params);
+    else
+      printf(MSG_CONFIG);
+    return runSolve(&options, &params);
+  }
+
+  if(options.serve)
+  {
+    if(argc - first_arg > 1)
+    {
+      printf(MSG_PARAMETER);
+      return 1;
+    }
+    setStandard(&params, 0, 0);
+    if(argc - first_arg == 1)
+      readConfig(argv[first_arg], &params);
+    else
+      printf(MSG_CONFIG);
+    return runServer(&options, &params);
+  }
+
+  if(options.overlay)
+  {
+    if((argc - first_arg < 1) | (argc - first_arg > 2))
+    {
+      printf(MSG_PARAMETER);
+      return 1;
+    }
+    if(redirectMessages(argv[first_arg], &options) != 0)
+      return 3;
+    setStandard(&params, 0, 0);
+    if(argc - first_arg == 2)
+      readConfig(argv[first_arg + 1], &params);
+    else
+      printf(MSG_CONFIG);
+    if(options.shm_name && (status = openRing(&options, &params, &ring)) != 0)
+    {
+      printf((status == 1) ? MSG_SHM_EXISTS : MSG_SHM);
+      return 3;
+    }
+    memset(&overlay, 0, sizeof(Overlay));
+    memset(&context, 0, sizeof(RenderContext));
+    if(options.layer_dir)
+    {
+      initLayerCache(&layers, options.layer_dir);
+      options.layers = &layers;
+    }
+    takeSlot(&options, &params, argv[first_arg], 1);
+    if((status = readOverlay(options.overlay, &params, &overlay)) == 0 &&
+        (status = renderOverlay(argv[first_arg], &params, &options, &context,
+        &overlay)) != 0)
+      printf("%s", statusMessage(status));
+    else if(!status && options.stats)
+      printStats(&context);
+    giveSlot(&options, status);
+    freeOverlay(&overlay);
+    freeRenderContext(&context);
+    if(options.layers)
+      freeLayerCache(&layers);
+    if(options.ring)
+      closeRing(&ring, &params);
+    return status;
+  }
+
+  if((argc - first_arg < 3) | (argc - first_arg > 4))
+  {
+    printf(MSG_PARAMETER);
+    return 1;
+  }
+  // the image goes to stdout, so all messages are moved to stderr
+  if(redirectMessages(argv[first_arg + 2], &options) != 0)
+    return 3;
+  setStandard(&params, strtof(argv[first_arg],NULL),
+      strtof(argv[first_arg + 1],NULL));
+  if(argc - first_arg == 4)
+  {
+    readConfig(argv[first_arg + 3], &params);
+  }
+  else
+  {
+    printf(MSG_CONFIG);
+  }
+  if(options.shm_name && (status = openRing(&options, &params, &ring)) != 0)
+  {
+    printf((status == 1) ? MSG_SHM_EXISTS : MSG_SHM);
+    return 3;
+  }
+
+  memset(&context, 0, sizeof(RenderContext));
+  if(options.layer_dir)
+  {
+    initLayerCache(&layers, options.layer_dir);
+    options.layers = &layers;
+  }
+  if(options.animate)
+    status = renderAnimation(argv[first_arg + 2], &params, &options,
+        &context);
+  else
+  {
+    takeSlot(&options, &params, argv[first_arg + 2], 1);
+    status = renderCached(argv[first_arg + 2], &params, &options, &context,
+        &stats);
+    giveSlot(&options, status);
+  }
+  if(status != 0)
+    printf("%s", statusMessage(status));
+  else if(options.stats)
+  {
+    printStats(&context);
+    if(options.animate)
+      printf(MSG_FRAMES, context.point_count);
+    else if(options.cache_dir && !options.composite)
+      printCacheStats(&stats);
+  }
+  freeRenderContext(&context);
+  if(options.layers)
+    freeLayerCache(&layers);
+  if(options.ring)
+    closeRing(&ring, &params);
+
+  return status;
+}